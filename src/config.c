@@ -21,7 +21,19 @@ void read_config(char *path) {
     runtime.log_level = LOG_INFO;
     memcpy(&runtime.lte.interface_name, "wwan0", 5);
     memcpy(&runtime.dsl.interface_name, "ppp0", 4);
-    runtime.reorder_buffer_timeout.tv_usec = 250 * 1000;
+    runtime.reorder_buffer_timeout = 250 * 1000;
+    runtime.reorder_buffer_timeout_min.tv_usec = 20 * 1000;
+    runtime.reorder_buffer_timeout_max.tv_usec = 500 * 1000;
+    runtime.reorder_buffer_size = 1024;
+    runtime.reorder_buffer_codel_interval.tv_usec = 100 * 1000;
+    runtime.receive_batch_size = 32;
+    runtime.send_batch_size = 32;
+    runtime.dsl_upstream_burst = 10;
+    runtime.flowlet_timeout = FLOWLET_TIMEOUT_DEFAULT;
+    runtime.flowlet_timeout_adaptive = true;
+    /* cs5, voice admit, ef, cs6 and cs7 */
+    runtime.upstream_priority.dscp = (1ULL << 40) | (1ULL << 44) | (1ULL << 46) | (1ULL << 48) | (1ULL << 56);
+    runtime.tunnel_queues = 1;
 
     FILE *fp = fopen(path, "r");
     if (!fp) {
@@ -67,6 +79,12 @@ void read_config(char *path) {
                 } else if (strcmp(value, "false") != 0) {
                     logger(LOG_WARNING, "Invalid bonding config '%s', falling back to 'false'.\n", value);
                 }
+            } else if (strncmp(line, "sequence soak test =", 20) == 0) {
+                if (strcmp(value, "true") == 0) {
+                    runtime.sequence_soak_test = true;
+                } else if (strcmp(value, "false") != 0) {
+                    logger(LOG_WARNING, "Invalid sequence soak test config '%s', falling back to 'false'.\n", value);
+                }
             } else if (strncmp(line, "log level =", 11) == 0) {
                 if (strcmp(value, "none") == 0) {
                     runtime.log_level = LOG_NONE;
@@ -92,6 +110,19 @@ void read_config(char *path) {
                     logger(LOG_FATAL, "Maximum size for 'gre interface mtu' config is 1448.\n");
                 }
                 runtime.tunnel_interface_mtu = atoi(value);
+            } else if (strncmp(line, "tunnel queues =", 15) == 0) {
+                if (atoi(value) < 1) {
+                    logger(LOG_FATAL, "Minimum value for 'tunnel queues' config is 1.\n");
+                } else if (atoi(value) > MAX_TUNNEL_QUEUES) {
+                    logger(LOG_FATAL, "Maximum value for 'tunnel queues' config is %u.\n", MAX_TUNNEL_QUEUES);
+                }
+                runtime.tunnel_queues = atoi(value);
+            } else if (strncmp(line, "tunnel offload =", 16) == 0) {
+                if (strcmp(value, "true") == 0) {
+                    runtime.tunnel_offload = true;
+                } else if (strcmp(value, "false") != 0) {
+                    logger(LOG_WARNING, "Invalid tunnel offload config '%s', falling back to 'false'.\n", value);
+                }
             } else if (strncmp(line, "active hello interval =", 23) == 0) {
                 runtime.haap.active_hello_interval = atoi(value);
             } else if (strncmp(line, "hello retry times =", 19) == 0) {
@@ -100,8 +131,169 @@ void read_config(char *path) {
                 memset(&runtime.event_script_path, 0, sizeof(runtime.event_script_path));
                 memcpy(&runtime.event_script_path, value, strlen(value));
             } else if (strncmp(line, "reorder buffer timeout =", 24) == 0) {
-                runtime.reorder_buffer_timeout.tv_sec = atoi(value) / 1000;
-                runtime.reorder_buffer_timeout.tv_usec = atoi(value) % 1000 * 1000;
+                if (strcmp(value, "auto") == 0) {
+                    runtime.reorder_buffer_timeout_adaptive = true;
+                } else {
+                    runtime.reorder_buffer_timeout_adaptive = false;
+                    runtime.reorder_buffer_timeout = (uint64_t)atoi(value) * 1000;
+                }
+            } else if (strncmp(line, "reorder buffer timeout min =", 28) == 0) {
+                if (atoi(value) < 1) {
+                    logger(LOG_FATAL, "Minimum value for 'reorder buffer timeout min' config is 1.\n");
+                }
+                runtime.reorder_buffer_timeout_min.tv_sec = atoi(value) / 1000;
+                runtime.reorder_buffer_timeout_min.tv_usec = atoi(value) % 1000 * 1000;
+            } else if (strncmp(line, "reorder buffer timeout max =", 28) == 0) {
+                runtime.reorder_buffer_timeout_max.tv_sec = atoi(value) / 1000;
+                runtime.reorder_buffer_timeout_max.tv_usec = atoi(value) % 1000 * 1000;
+            } else if (strncmp(line, "reorder buffer size =", 21) == 0) {
+                if (atoi(value) < 64) {
+                    logger(LOG_FATAL, "Minimum size for 'reorder buffer size' config is 64.\n");
+                } else if (atoi(value) > 65536) {
+                    logger(LOG_FATAL, "Maximum size for 'reorder buffer size' config is 65536.\n");
+                }
+                /* ring buffer is indexed by sequence, round up to the next power of two */
+                runtime.reorder_buffer_size = 1;
+                while (runtime.reorder_buffer_size < atoi(value))
+                    runtime.reorder_buffer_size <<= 1;
+            } else if (strncmp(line, "reorder buffer bytes =", 22) == 0) {
+                if ((atoi(value) != 0) && (atoi(value) < MAX_PKT_SIZE)) {
+                    logger(LOG_FATAL, "Minimum size for 'reorder buffer bytes' config is %u.\n", MAX_PKT_SIZE);
+                }
+                runtime.reorder_buffer_bytes = atoi(value);
+            } else if (strncmp(line, "reorder buffer codel target =", 29) == 0) {
+                runtime.reorder_buffer_codel_target.tv_sec = atoi(value) / 1000;
+                runtime.reorder_buffer_codel_target.tv_usec = atoi(value) % 1000 * 1000;
+            } else if (strncmp(line, "reorder buffer codel interval =", 31) == 0) {
+                if (atoi(value) < 1) {
+                    logger(LOG_FATAL, "Minimum value for 'reorder buffer codel interval' config is 1.\n");
+                }
+                runtime.reorder_buffer_codel_interval.tv_sec = atoi(value) / 1000;
+                runtime.reorder_buffer_codel_interval.tv_usec = atoi(value) % 1000 * 1000;
+            } else if (strncmp(line, "reorder buffer bypass protocols =", 33) == 0) {
+                for (char *token = strtok(value, " ,"); token; token = strtok(NULL, " ,")) {
+                    if (strcmp(token, "udp") == 0) {
+                        runtime.reorder_buffer_bypass.udp = true;
+                    } else if (strcmp(token, "icmp") == 0) {
+                        runtime.reorder_buffer_bypass.icmp = true;
+                    } else {
+                        logger(LOG_WARNING, "Ignoring invalid protocol '%s' in 'reorder buffer bypass protocols' config.\n", token);
+                        continue;
+                    }
+                    runtime.reorder_buffer_bypass.enabled = true;
+                }
+            } else if (strncmp(line, "reorder buffer bypass ports =", 29) == 0) {
+                for (char *token = strtok(value, " ,"); token; token = strtok(NULL, " ,")) {
+                    if ((atoi(token) < 1) || (atoi(token) > 65535)) {
+                        logger(LOG_WARNING, "Ignoring invalid port '%s' in 'reorder buffer bypass ports' config.\n", token);
+                        continue;
+                    }
+                    runtime.reorder_buffer_bypass.ports[atoi(token) / 8] |= 1 << (atoi(token) % 8);
+                    runtime.reorder_buffer_bypass.enabled = true;
+                }
+            } else if (strncmp(line, "reorder buffer bypass dscp =", 28) == 0) {
+                for (char *token = strtok(value, " ,"); token; token = strtok(NULL, " ,")) {
+                    if ((atoi(token) < 0) || (atoi(token) > 63)) {
+                        logger(LOG_WARNING, "Ignoring invalid dscp '%s' in 'reorder buffer bypass dscp' config.\n", token);
+                        continue;
+                    }
+                    runtime.reorder_buffer_bypass.dscp |= 1ULL << atoi(token);
+                    runtime.reorder_buffer_bypass.enabled = true;
+                }
+            } else if (strncmp(line, "receive batch size =", 20) == 0) {
+                if (atoi(value) < 1) {
+                    logger(LOG_FATAL, "Minimum size for 'receive batch size' config is 1.\n");
+                } else if (atoi(value) > 1024) { /* UIO_MAXIOV */
+                    logger(LOG_FATAL, "Maximum size for 'receive batch size' config is 1024.\n");
+                }
+                runtime.receive_batch_size = atoi(value);
+            } else if (strncmp(line, "receive backend =", 17) == 0) {
+                if (strcmp(value, "socket") == 0) {
+                    runtime.receive_backend = RECEIVE_BACKEND_SOCKET;
+                } else if (strcmp(value, "xdp") == 0) {
+                    runtime.receive_backend = RECEIVE_BACKEND_XDP;
+                } else if (strcmp(value, "tpacket") == 0) {
+                    runtime.receive_backend = RECEIVE_BACKEND_TPACKET;
+                } else {
+                    logger(LOG_WARNING, "Invalid receive backend config '%s', falling back to 'socket'.\n", value);
+                }
+            } else if (strncmp(line, "xdp mode =", 10) == 0) {
+                if (strcmp(value, "native") == 0) {
+                    runtime.xdp_native = true;
+                } else if (strcmp(value, "skb") != 0) {
+                    logger(LOG_WARNING, "Invalid xdp mode config '%s', falling back to 'skb'.\n", value);
+                }
+            } else if (strncmp(line, "io uring =", 10) == 0) {
+                if (strcmp(value, "true") == 0) {
+                    runtime.io_uring = true;
+                } else if (strcmp(value, "false") != 0) {
+                    logger(LOG_WARNING, "Invalid io uring config '%s', falling back to 'false'.\n", value);
+                }
+            } else if (strncmp(line, "send batch size =", 17) == 0) {
+                if (atoi(value) < 1) {
+                    logger(LOG_FATAL, "Minimum size for 'send batch size' config is 1.\n");
+                } else if (atoi(value) > 1024) { /* UIO_MAXIOV */
+                    logger(LOG_FATAL, "Maximum size for 'send batch size' config is 1024.\n");
+                }
+                runtime.send_batch_size = atoi(value);
+            } else if (strncmp(line, "send queue size =", 17) == 0) {
+                if (atoi(value) < 0) {
+                    logger(LOG_FATAL, "Minimum size for 'send queue size' config is 0.\n");
+                } else if (atoi(value) > 65536) {
+                    logger(LOG_FATAL, "Maximum size for 'send queue size' config is 65536.\n");
+                }
+                runtime.send_queue_size = atoi(value);
+            } else if (strncmp(line, "send queue policy =", 19) == 0) {
+                if (strcmp(value, "drop") == 0) {
+                    runtime.send_queue_policy = SEND_QUEUE_POLICY_DROP;
+                } else if (strcmp(value, "overflow") == 0) {
+                    runtime.send_queue_policy = SEND_QUEUE_POLICY_OVERFLOW;
+                } else {
+                    logger(LOG_WARNING, "Invalid send queue policy config '%s', falling back to 'drop'.\n", value);
+                }
+            } else if (strncmp(line, "dsl upstream rate =", 19) == 0) {
+                runtime.dsl_upstream_rate = atoi(value);
+            } else if (strncmp(line, "dsl upstream burst =", 20) == 0) {
+                if (atoi(value) < 1) {
+                    logger(LOG_FATAL, "Minimum value for 'dsl upstream burst' config is 1.\n");
+                }
+                runtime.dsl_upstream_burst = atoi(value);
+            } else if (strncmp(line, "lte upstream rate =", 19) == 0) {
+                runtime.lte_upstream_rate = atoi(value);
+            } else if (strncmp(line, "upstream scheduler =", 20) == 0) {
+                if (strcmp(value, "overflow") == 0) {
+                    runtime.upstream_scheduler = UPSTREAM_SCHEDULER_OVERFLOW;
+                } else if (strcmp(value, "earliest arrival") == 0) {
+                    runtime.upstream_scheduler = UPSTREAM_SCHEDULER_EARLIEST_ARRIVAL;
+                } else {
+                    logger(LOG_WARNING, "Invalid upstream scheduler config '%s', falling back to 'overflow'.\n", value);
+                }
+            } else if (strncmp(line, "upstream priority dscp =", 24) == 0) {
+                runtime.upstream_priority.dscp = 0;
+                for (char *token = strtok(value, " ,"); token; token = strtok(NULL, " ,")) {
+                    if (strcmp(token, "none") == 0) {
+                        continue;
+                    } else if ((atoi(token) < 0) || (atoi(token) > 63)) {
+                        logger(LOG_WARNING, "Ignoring invalid dscp '%s' in 'upstream priority dscp' config.\n", token);
+                        continue;
+                    }
+                    runtime.upstream_priority.dscp |= 1ULL << atoi(token);
+                }
+            } else if (strncmp(line, "upstream priority ports =", 25) == 0) {
+                for (char *token = strtok(value, " ,"); token; token = strtok(NULL, " ,")) {
+                    if ((atoi(token) < 1) || (atoi(token) > 65535)) {
+                        logger(LOG_WARNING, "Ignoring invalid port '%s' in 'upstream priority ports' config.\n", token);
+                        continue;
+                    }
+                    runtime.upstream_priority.ports[atoi(token) / 8] |= 1 << (atoi(token) % 8);
+                }
+            } else if (strncmp(line, "flowlet timeout =", 17) == 0) {
+                if (strcmp(value, "auto") == 0) {
+                    runtime.flowlet_timeout_adaptive = true;
+                } else {
+                    runtime.flowlet_timeout_adaptive = false;
+                    runtime.flowlet_timeout = (uint64_t)atoi(value) * 1000;
+                }
             } else {
                 logger(LOG_WARNING, "Ignoring invalid line in config file: %s\n", line);
             }
@@ -124,6 +316,13 @@ void read_config(char *path) {
 
     }
     runtime.haap.ip = runtime.haap.anycast_ip;
+    if (runtime.reorder_buffer_timeout_adaptive) {
+        if (timercmp(&runtime.reorder_buffer_timeout_max, &runtime.reorder_buffer_timeout_min, <)) {
+            logger(LOG_FATAL, "'reorder buffer timeout max' config must not be lower than 'reorder buffer timeout min'.\n");
+        }
+        /* wait as long as allowed until round trip times of both tunnels are known */
+        runtime.reorder_buffer_timeout = (uint64_t)runtime.reorder_buffer_timeout_max.tv_sec * 1000000 + runtime.reorder_buffer_timeout_max.tv_usec;
+    }
     if (!runtime.tunnel_interface_mtu) {
         runtime.tunnel_interface_mtu = 1448; /* 1500 - ipv6 header(40) - gre header(12) */
         if (runtime.bonding) {
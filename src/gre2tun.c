@@ -20,147 +20,1375 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
-void *gre2tun_main() {
-    char trimifname[IF_NAMESIZE-6];
-    char threadname[IF_NAMESIZE];
-    strncpy(trimifname, runtime.tunnel_interface_name, IF_NAMESIZE-7);
-    sprintf(threadname, "%s-recv", trimifname);
-    pthread_setname_np(pthread_self(), threadname);
+/* adaptive timeout: difference of the smoothed round trip times plus twice their variation, within min/max */
+void update_reorder_buffer_timeout() {
+    if (!runtime.reorder_buffer_timeout_adaptive)
+        return;
 
-    struct reorder_buffer_element {
-        uint32_t sequence;
-        struct timeval timestamp;
-        void *packet;
-        uint16_t size;
-    };
-    struct {
-        struct reorder_buffer_element *packets;
-        struct reorder_buffer_element *packets_old;
-        uint32_t size;
-    } reorder_buffer = {};
+    struct timeval timeout;
+    if ((!timerisset(&runtime.lte.smoothed_round_trip_time)) || (!timerisset(&runtime.dsl.smoothed_round_trip_time))) {
+        timeout = runtime.reorder_buffer_timeout_max;
+    } else {
+        if (timercmp(&runtime.lte.smoothed_round_trip_time, &runtime.dsl.smoothed_round_trip_time, >))
+            timersub(&runtime.lte.smoothed_round_trip_time, &runtime.dsl.smoothed_round_trip_time, &timeout);
+        else
+            timersub(&runtime.dsl.smoothed_round_trip_time, &runtime.lte.smoothed_round_trip_time, &timeout);
+        timeradd(&timeout, &runtime.lte.round_trip_time_variation, &timeout);
+        timeradd(&timeout, &runtime.lte.round_trip_time_variation, &timeout);
+        timeradd(&timeout, &runtime.dsl.round_trip_time_variation, &timeout);
+        timeradd(&timeout, &runtime.dsl.round_trip_time_variation, &timeout);
 
-    unsigned char buffer[MAX_PKT_SIZE];
-    ssize_t size;
+        if (timercmp(&timeout, &runtime.reorder_buffer_timeout_min, <))
+            timeout = runtime.reorder_buffer_timeout_min;
+        else if (timercmp(&timeout, &runtime.reorder_buffer_timeout_max, >))
+            timeout = runtime.reorder_buffer_timeout_max;
+    }
+
+    /* published as a single word, the receiver reads it without locking */
+    uint64_t usec = (uint64_t)timeout.tv_sec * 1000000 + timeout.tv_usec;
+    if (usec != atomic_load_explicit(&runtime.reorder_buffer_timeout, memory_order_relaxed)) {
+        logger(LOG_DEBUG, "Reorder buffer timeout adjusted to %u.%03u seconds.\n", timeout.tv_sec, timeout.tv_usec / 1000);
+        atomic_store_explicit(&runtime.reorder_buffer_timeout, usec, memory_order_relaxed);
+    }
+}
+
+/* wake up the receiver if a tunnel came up or went down */
+void update_tunnel_state() {
+    static bool lte_established = false;
+    static bool dsl_established = false;
+    if ((runtime.lte.tunnel_established == lte_established) && (runtime.dsl.tunnel_established == dsl_established))
+        return;
+    lte_established = runtime.lte.tunnel_established;
+    dsl_established = runtime.dsl.tunnel_established;
+    if (eventfd_write(eventfd_tunnel_state, 1) < 0) {
+        logger(LOG_ERROR, "Signalling tunnel state change failed: %s\n", strerror(errno));
+    }
+}
+
+/* consecutive packets far behind the window it takes to assume the haap started over */
+#define REORDER_BUFFER_RESYNC_THRESHOLD 16
+
+/* RFC 1982 serial number arithmetic, sequence numbers wrap around every 2^32 packets
+ * a is after b if it is less than 2^31 ahead of it */
+static inline bool sequence_after(uint32_t a, uint32_t b) {
+    return (a != b) && (a - b < 0x80000000);
+}
+
+struct reorder_buffer_element {
     uint32_t sequence;
-    uint32_t sequence_flushed = UINT32_MAX;
+    void *packet; /* NULL if slot is empty */
+    uint16_t size;
+    struct timeval timestamp;
+    bool delivered; /* already written, only holds its place in the sequence, packet must not be used */
+};
 
-    uint8_t payload_offset;
-    struct grehdr *greh;
-    struct sockaddr_in6 saddr = {};
-    socklen_t saddr_size = sizeof(saddr);
+struct reorder_buffer_arrival {
+    uint32_t sequence;
+    struct timeval timestamp;
+};
+
+/* each tunnel delivers in-order, so anything below its highest sequence that's missing went via the other one */
+struct reorder_buffer_link {
+    bool active;
+    uint32_t sequence_highest;
+};
 
-    bool flushed_something;
-    uint16_t reorder_buffer_freeable;
+/* RFC 8289 codel, applied to the time packets spent in the reorder buffer */
+struct reorder_buffer_codel {
+    bool dropping;
+    uint32_t count;
+    uint32_t count_last;
+    struct timeval first_above_time;
+    struct timeval drop_next;
+};
 
+struct reorder_buffer {
+    /* ring of packets, indexed by sequence % capacity */
+    struct reorder_buffer_element *packets;
+    uint32_t capacity;
+    /* one bit per ring slot, set if the slot holds a packet, allows to skip large gaps quickly */
+    uint64_t *occupied;
+    /* fifo of buffered sequences in order of arrival, the oldest packet is always at the head */
+    struct reorder_buffer_arrival *arrivals;
+    uint32_t arrivals_head;
+    uint32_t arrivals_count;
+    /* nothing received yet, next packet sets the sequence */
+    bool synchronized;
+    uint32_t sequence_flushed;
+    uint32_t far_behind;
+    /* buffered packets are slots of this pool */
+    struct packet_pool *pool;
+    struct tun_output *output;
+    uint32_t bytes;
+    struct reorder_buffer_link lte;
+    struct reorder_buffer_link dsl;
+    struct reorder_buffer_codel codel;
+    /* only one tunnel is up, there is nothing to reorder */
+    bool passthrough;
+    /* time the current receive batch is processed at */
     struct timeval now;
-    struct timeval age;
+    /* soak test: shift sequences received from the haap so they wrap around shortly after the start */
+    uint32_t sequence_offset;
+    bool sequence_offset_set;
+};
+
+/* with offloads enabled, every packet written to the tun device needs a vnet header */
+static void tun_write(int fd, void *packet, uint16_t size) {
+    ssize_t written;
+    if (runtime.tunnel_offload) {
+        struct virtio_net_hdr vnet = {};
+        struct iovec iovecs[2] = {
+            { .iov_base = &vnet, .iov_len = sizeof(vnet) },
+            { .iov_base = packet, .iov_len = size },
+        };
+        written = writev(fd, iovecs, 2) - (ssize_t)sizeof(vnet);
+    } else {
+        written = write(fd, packet, size);
+    }
+    if (written != size) {
+        logger(LOG_ERROR, "Tun device write failed: %s\n", strerror(errno));
+    }
+}
+
+/* with multiple tun device queues, packets are written by one thread per queue while the receiver keeps sequencing */
+#define TUN_WRITER_QUEUE_SIZE 256
+
+struct tun_writer {
+    pthread_t thread;
+    uint8_t queue;
+    int fd;
+    /* segments being coalesced, with offloads enabled */
+    struct gro gro;
+    /* written packets go straight back into this pool if the receiver writes itself */
+    struct packet_pool *pool;
+    /* wakes the writer up, signalled once per receive batch */
+    int eventfd;
+    bool pending;
+    /* packets to write, and their slots going back to the receiver to be put into the pool */
+    struct ring packets;
+    struct ring returned;
+    /* writes are queued on an io_uring instead, if set */
+    struct tun_writer_uring *uring;
+};
+
+/* with io_uring, direct tun device writes are submitted together, once per receive batch or when the queue is full */
+#define TUN_WRITER_URING_SIZE 256
+
+struct tun_writer_uring {
+    struct uring ring;
+    uint16_t writes;
+    /* vnet headers and iovecs of queued writes, and the slots to release once they are done */
+    struct virtio_net_hdr vnets[TUN_WRITER_URING_SIZE];
+    struct iovec iovecs[TUN_WRITER_URING_SIZE * 2];
+    uint16_t iovec_count;
+    void *packets[TUN_WRITER_URING_SIZE];
+    uint16_t packet_count;
+};
+
+struct tun_output {
+    struct packet_pool *pool;
+    struct tun_writer writers[MAX_TUNNEL_QUEUES];
+    uint8_t count; /* 0 if the receiver writes to the tun device itself, using the first writer */
+};
+
+/* pass a slot the writer is done with back to the receiver */
+static void tun_writer_release(struct tun_writer *w, void *packet) {
+    if (w->pool)
+        pool_put(w->pool, packet);
+    else
+        ring_push(&w->returned, packet, 0); /* can't fill up, it is large enough to hold every slot of the pool */
+}
+
+/* write everything queued with a single system call, then release the slots */
+static void tun_writer_submit(struct tun_writer *w) {
+    struct tun_writer_uring *u = w->uring;
+    if (u->writes == 0)
+        return;
+
+    /* writes aren't linked, a failed one must not take the rest of the batch down with it
+     * tun device writes complete inline, in submission order */
+    uint16_t remaining = u->writes;
+    struct io_uring_cqe *cqe;
+    int res = uring_submit(&u->ring, remaining);
+    while ((res >= 0) && (remaining > 0)) {
+        if ((cqe = uring_cqe(&u->ring)) == NULL) {
+            res = uring_submit(&u->ring, 1);
+            continue;
+        }
+        if (cqe->res < 0)
+            logger(LOG_ERROR, "Tun device write failed: %s\n", strerror(-cqe->res));
+        uring_cqe_seen(&u->ring);
+        remaining--;
+    }
+    if (res < 0)
+        logger(LOG_ERROR, "Tun device write submission failed: %s\n", strerror(errno));
+
+    for (int i=0; i<u->packet_count; i++)
+        tun_writer_release(w, u->packets[i]);
+    u->writes = 0;
+    u->iovec_count = 0;
+    u->packet_count = 0;
+}
+
+/* queue a write of the given iovecs, preceded by a vnet header if there is one
+ * the packets they are made of are released once it's done */
+static void tun_writer_queue(struct tun_writer *w, struct virtio_net_hdr *vnet, struct iovec *iovecs, int iovcnt, void **packets, uint16_t count) {
+    struct tun_writer_uring *u = w->uring;
+    if ((u->writes == TUN_WRITER_URING_SIZE) || (u->iovec_count + iovcnt + 1 > TUN_WRITER_URING_SIZE * 2) || (u->packet_count + count > TUN_WRITER_URING_SIZE))
+        tun_writer_submit(w);
+
+    /* the queue is large enough to hold every queued write */
+    struct io_uring_sqe *sqe = uring_sqe(&u->ring);
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+    if (vnet) {
+        struct iovec *v = &u->iovecs[u->iovec_count];
+        u->vnets[u->writes] = *vnet;
+        v[0].iov_base = &u->vnets[u->writes];
+        v[0].iov_len = sizeof(struct virtio_net_hdr);
+        memcpy(&v[1], iovecs, iovcnt * sizeof(struct iovec));
+        u->iovec_count += iovcnt + 1;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)v;
+        sqe->len = iovcnt + 1;
+    } else {
+        /* pool slots are within the registered buffer */
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (uintptr_t)iovecs[0].iov_base;
+        sqe->len = iovecs[0].iov_len;
+        sqe->buf_index = 0;
+    }
+    memcpy(&u->packets[u->packet_count], packets, count * sizeof(void *));
+    u->packet_count += count;
+    u->writes++;
+}
+
+static bool tun_writer_uring_open(struct tun_writer *w) {
+    struct tun_writer_uring *u = calloc(1, sizeof(struct tun_writer_uring));
+    if (!u)
+        return false;
+    u->ring.fd = -1;
+    if ((!uring_open(&u->ring, TUN_WRITER_URING_SIZE)) || (!uring_register_files(&u->ring, &w->fd, 1)) ||
+        (!uring_register_buffer(&u->ring, w->pool->slab, (size_t)w->pool->slots * w->pool->slot_size))) {
+        uring_close(&u->ring);
+        free(u);
+        return false;
+    }
+    w->uring = u;
+    return true;
+}
+
+static void tun_writer_uring_close(void *arg) {
+    struct tun_writer *w = (struct tun_writer *)arg;
+    if (!w->uring)
+        return;
+    uring_close(&w->uring->ring);
+    free(w->uring);
+    w->uring = NULL;
+}
+
+/* write out the coalesced packet, if there is one */
+static void tun_writer_flush(struct tun_writer *w) {
+    if (w->gro.count == 0)
+        return;
+    int iovcnt = gro_finish(&w->gro);
+    if (w->uring) {
+        tun_writer_queue(w, &w->gro.vnet, &w->gro.iovecs[1], iovcnt - 1, w->gro.packets, w->gro.count);
+        w->gro.count = 0;
+        return;
+    }
+    if (writev(w->fd, w->gro.iovecs, iovcnt) != w->gro.size + sizeof(struct virtio_net_hdr)) {
+        logger(LOG_ERROR, "Tun device write failed: %s\n", strerror(errno));
+    }
+    for (int i=0; i<w->gro.count; i++)
+        tun_writer_release(w, w->gro.packets[i]);
+    w->gro.count = 0;
+}
+
+/* segments of a tcp flow are held back and handed to the tun device as one large packet */
+static void tun_writer_write(struct tun_writer *w, void *packet, uint16_t size) {
+    if (runtime.tunnel_offload) {
+        if ((w->gro.count > 0) && (gro_append(&w->gro, packet, size))) {
+            if (w->gro.closed)
+                tun_writer_flush(w);
+            return;
+        }
+        tun_writer_flush(w);
+        if (gro_start(&w->gro, packet, size)) {
+            if (w->gro.closed)
+                tun_writer_flush(w);
+            return;
+        }
+    }
+    if (w->uring) {
+        struct virtio_net_hdr vnet = {};
+        struct iovec iovec = { .iov_base = packet, .iov_len = size };
+        tun_writer_queue(w, runtime.tunnel_offload ? &vnet : NULL, &iovec, 1, &packet, 1);
+        return;
+    }
+    tun_write(w->fd, packet, size);
+    tun_writer_release(w, packet);
+}
+
+static void *tun_writer_main(void *arg) {
+    struct tun_writer *w = (struct tun_writer *)arg;
+    char threadname[IF_NAMESIZE];
+    snprintf(threadname, sizeof(threadname), "%.8s-out%hhu", runtime.tunnel_interface_name, w->queue);
+    pthread_setname_np(pthread_self(), threadname);
 
+    void *packet;
+    uint16_t size;
+    eventfd_t wakeups;
     while (true) {
-        size = recvfrom(sockfd_gre, buffer, MAX_PKT_SIZE, 0, (struct sockaddr *)&saddr, &saddr_size);
+        while (ring_pop(&w->packets, &packet, &size))
+            tun_writer_write(w, packet, size);
+        /* nothing more to coalesce with for now */
+        tun_writer_flush(w);
+        eventfd_read(w->eventfd, &wakeups);
+    }
+    return NULL;
+}
+
+/* keep packets of a flow on the same queue, so they stay in-order */
+static uint32_t tun_output_hash(unsigned char *packet, uint16_t size) {
+    uint32_t hash = 0;
+    uint32_t word;
+    int start, end;
+    if ((size >= 20) && ((packet[0] >> 4) == 4)) {
+        start = 12;
+        end = 20;
+    } else if ((size >= 40) && ((packet[0] >> 4) == 6)) {
+        start = 8;
+        end = 40;
+    } else {
+        return 0;
+    }
+    for (int i=start; i<end; i+=4) {
+        memcpy(&word, packet + i, sizeof(word));
+        hash ^= word;
+    }
+    return hash * 0x9e3779b1;
+}
+
+/* hand a pool slot over to the tun device, it goes back into the pool once written */
+static void tun_output_write(struct tun_output *out, void *packet, uint16_t size) {
+    if (out->count == 0) {
+        tun_writer_write(&out->writers[0], packet, size);
+        return;
+    }
+
+    struct tun_writer *w = &out->writers[(uint64_t)tun_output_hash(packet, size) * out->count >> 32];
+    if (!ring_push(&w->packets, packet, size)) {
+        /* writer can't keep up, waiting for it would hold up receiving and the other queues */
+        eventfd_write(w->eventfd, 1);
+        runtime.stats.tun_output_dropped++;
+        pool_put(out->pool, packet);
+        return;
+    }
+    w->pending = true;
+}
+
+/* wake up writers that got packets since the last call, called once per receive batch */
+static void tun_output_wakeup(struct tun_output *out) {
+    if (out->count == 0) {
+        tun_writer_flush(&out->writers[0]);
+        if (out->writers[0].uring)
+            tun_writer_submit(&out->writers[0]);
+    }
+    for (int i=0; i<out->count; i++) {
+        if (out->writers[i].pending) {
+            out->writers[i].pending = false;
+            eventfd_write(out->writers[i].eventfd, 1);
+        }
+    }
+}
+
+/* put slots of written packets back into the pool */
+static void tun_output_reclaim(struct tun_output *out) {
+    void *packet;
+    uint16_t size;
+    for (int i=0; i<out->count; i++) {
+        while (ring_pop(&out->writers[i].returned, &packet, &size))
+            pool_put(out->pool, packet);
+    }
+}
 
-        if ((size <= 0) && (errno != EAGAIN)) {
-            logger(LOG_ERROR, "Raw socket receive failed: %s\n", strerror(errno));
+static void tun_output_stop(void *arg) {
+    struct tun_output *out = (struct tun_output *)arg;
+    for (int i=0; i<out->count; i++) {
+        pthread_cancel(out->writers[i].thread);
+        pthread_join(out->writers[i].thread, NULL);
+        close(out->writers[i].eventfd);
+        ring_destroy(&out->writers[i].packets);
+        ring_destroy(&out->writers[i].returned);
+    }
+    out->count = 0;
+}
+
+/* one writer thread per tun device queue, unless there is just one queue */
+static void tun_output_start(struct tun_output *out) {
+    struct tun_writer *w;
+    out->writers[0].fd = sockfd_tun;
+    out->writers[0].pool = out->pool;
+    out->writers[0].gro.count = 0;
+    if (runtime.tunnel_queues < 2)
+        return;
+    for (uint8_t i=0; i<runtime.tunnel_queues; i++) {
+        w = &out->writers[out->count];
+        w->queue = i;
+        w->fd = sockfd_tun_queues[i];
+        w->pool = NULL;
+        w->gro.count = 0;
+        w->pending = false;
+        w->eventfd = eventfd(0, 0);
+        if ((w->eventfd < 0) || (!ring_create(&w->packets, TUN_WRITER_QUEUE_SIZE)) || (!ring_create(&w->returned, out->pool->slots))) {
+            logger(LOG_ERROR, "Setting up writer for tun device queue %u failed.\n", i);
+        } else if (pthread_create(&w->thread, NULL, &tun_writer_main, w) != 0) {
+            logger(LOG_ERROR, "Starting writer thread for tun device queue %u failed.\n", i);
+        } else {
+            out->count++;
             continue;
         }
+        if (w->eventfd >= 0)
+            close(w->eventfd);
+        ring_destroy(&w->packets);
+        ring_destroy(&w->returned);
+    }
+}
 
-        if (size > 0) {
-            /* ignore packets with invalid source ips */
-            if (memcmp(&saddr.sin6_addr, &runtime.haap.ip, sizeof(struct in6_addr)) != 0) {
-                continue;
-            }
+static inline bool reorder_buffer_bypass_port(unsigned char *l4) {
+    uint16_t source = (l4[0] << 8) | l4[1];
+    uint16_t destination = (l4[2] << 8) | l4[3];
+    return (runtime.reorder_buffer_bypass.ports[source / 8] & (1 << (source % 8))) ||
+           (runtime.reorder_buffer_bypass.ports[destination / 8] & (1 << (destination % 8)));
+}
+
+/* peek at the inner ip header, true if the packet doesn't need to wait for missing packets before it */
+static bool reorder_buffer_bypass(unsigned char *packet, uint16_t size) {
+    uint8_t dscp;
+    uint8_t protocol;
+    uint16_t offset;
+    bool first_fragment = true;
 
-            /* extract sequence number and payload offset */
-            greh = (struct grehdr *)buffer;
-            if (greh->flags_and_version == htons(GRECP_FLAGSANDVERSION_WITH_SEQ)) {
-                memcpy(&sequence, buffer + sizeof(struct grehdr), sizeof(sequence));
-                sequence = ntohl(sequence);
-                payload_offset = 12;
-            } else if (greh->flags_and_version == htons(GRECP_FLAGSANDVERSION)) {
-                payload_offset = 8;
+    if ((size >= 20) && ((packet[0] >> 4) == 4)) {
+        dscp = packet[1] >> 2;
+        protocol = packet[9];
+        offset = (packet[0] & 0x0f) * 4;
+        first_fragment = ((((packet[6] << 8) | packet[7]) & 0x1fff) == 0);
+    } else if ((size >= 40) && ((packet[0] >> 4) == 6)) {
+        dscp = ((packet[0] & 0x0f) << 2) | (packet[1] >> 6);
+        protocol = packet[6];
+        offset = 40;
+        /* hop-by-hop, routing, fragment and destination options headers */
+        while (((protocol == 0) || (protocol == 43) || (protocol == 44) || (protocol == 60)) && (offset + 8 <= size)) {
+            if (protocol == 44) {
+                first_fragment = ((((packet[offset + 2] << 8) | packet[offset + 3]) & 0xfff8) == 0);
+                protocol = packet[offset];
+                offset += 8;
             } else {
-                logger(LOG_ERROR, "Received packet with invalid gre flags.\n");
+                protocol = packet[offset];
+                offset += (packet[offset + 1] + 1) * 8;
+            }
+        }
+    } else {
+        return false;
+    }
+
+    if (runtime.reorder_buffer_bypass.dscp & (1ULL << dscp))
+        return true;
+    switch (protocol) {
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            return runtime.reorder_buffer_bypass.icmp;
+        case IPPROTO_UDP:
+            if (runtime.reorder_buffer_bypass.udp)
+                return true;
+            /* fall through */
+        case IPPROTO_TCP:
+            return (first_fragment) && (offset + 4 <= size) && (reorder_buffer_bypass_port(packet + offset));
+    }
+    return false;
+}
+
+/* set ecn congestion experienced on an ip packet, returns false if it isn't ecn capable */
+static bool ecn_mark(unsigned char *packet, uint16_t size) {
+    uint8_t ecn;
+    uint16_t old, new;
+    uint32_t sum;
+    if ((size >= 20) && ((packet[0] >> 4) == 4)) {
+        ecn = packet[1] & 0x03;
+        if (ecn == 0)
+            return false;
+        if (ecn == 0x03)
+            return true;
+        /* RFC 1624 incremental checksum update of the first header word */
+        old = (packet[0] << 8) | packet[1];
+        new = old | 0x03;
+        sum = (uint16_t)~((packet[10] << 8) | packet[11]) + (uint16_t)~old + new;
+        sum = (sum & 0xffff) + (sum >> 16);
+        sum = (sum & 0xffff) + (sum >> 16);
+        packet[1] |= 0x03;
+        packet[10] = ~sum >> 8;
+        packet[11] = ~sum & 0xff;
+        return true;
+    } else if ((size >= 40) && ((packet[0] >> 4) == 6)) {
+        /* traffic class spans the first two bytes, ecn are its lowest bits */
+        ecn = (packet[1] >> 4) & 0x03;
+        if (ecn == 0)
+            return false;
+        packet[1] |= 0x30;
+        return true;
+    }
+    return false;
+}
+
+static uint32_t isqrt(uint64_t x) {
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > x)
+        bit >>= 2;
+    while (bit) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+/* next congestion signal is due interval / sqrt(count) after t */
+static void reorder_buffer_codel_control_law(struct reorder_buffer_codel *c, struct timeval t) {
+    uint64_t interval = runtime.reorder_buffer_codel_interval.tv_sec * 1000000ULL + runtime.reorder_buffer_codel_interval.tv_usec;
+    interval = interval * 1024 / isqrt((uint64_t)c->count << 20);
+    struct timeval step = { .tv_sec = interval / 1000000, .tv_usec = interval % 1000000 };
+    timeradd(&t, &step, &c->drop_next);
+}
+
+/* signal congestion once packets stayed longer than the target for a whole interval
+ * returns false if the packet has to be dropped because it can't be ecn marked */
+static bool reorder_buffer_codel(struct reorder_buffer *rb, struct reorder_buffer_element *e) {
+    struct reorder_buffer_codel *c = &rb->codel;
+    struct timeval sojourn;
+    bool above = false;
+
+    if (!timerisset(&runtime.reorder_buffer_codel_target))
+        return true;
+
+    timersub(&rb->now, &e->timestamp, &sojourn);
+    if (timercmp(&sojourn, &runtime.reorder_buffer_codel_target, <)) {
+        timerclear(&c->first_above_time);
+    } else if (!timerisset(&c->first_above_time)) {
+        timeradd(&rb->now, &runtime.reorder_buffer_codel_interval, &c->first_above_time);
+    } else if (!timercmp(&rb->now, &c->first_above_time, <)) {
+        above = true;
+    }
+
+    if (c->dropping) {
+        if (!above) {
+            c->dropping = false;
+            return true;
+        }
+        if (timercmp(&rb->now, &c->drop_next, <))
+            return true;
+        c->count++;
+        reorder_buffer_codel_control_law(c, c->drop_next);
+    } else {
+        if (!above)
+            return true;
+        c->dropping = true;
+        /* back above target shortly after the last dropping state ended, resume at about its rate */
+        timersub(&rb->now, &c->drop_next, &sojourn);
+        if ((c->count - c->count_last > 1) && (sojourn.tv_sec * 1000000LL + sojourn.tv_usec < (runtime.reorder_buffer_codel_interval.tv_sec * 1000000LL + runtime.reorder_buffer_codel_interval.tv_usec) * 16))
+            c->count = c->count - c->count_last;
+        else
+            c->count = 1;
+        c->count_last = c->count;
+        reorder_buffer_codel_control_law(c, rb->now);
+    }
+
+    if (ecn_mark(e->packet, e->size)) {
+        logger(LOG_CRAZYDEBUG, "Reorder buffer: Packet %u waited too long, setting ecn congestion experienced.\n", e->sequence);
+        runtime.stats.reorder_ecn_marked++;
+        return true;
+    }
+    logger(LOG_CRAZYDEBUG, "Reorder buffer: Packet %u waited too long, discarding.\n", e->sequence);
+    runtime.stats.reorder_codel_dropped++;
+    return false;
+}
+
+/* write packet with given sequence to the tun device, if we have it */
+static void reorder_buffer_release(struct reorder_buffer *rb, uint32_t sequence) {
+    uint32_t slot = sequence & (rb->capacity - 1);
+    struct reorder_buffer_element *e = &rb->packets[slot];
+    if ((e->packet) && (e->sequence == sequence)) {
+        if (!e->delivered) {
+            rb->bytes -= e->size;
+            if (reorder_buffer_codel(rb, e))
+                tun_output_write(rb->output, e->packet, e->size);
+            else
+                pool_put(rb->pool, e->packet);
+        }
+        e->packet = NULL;
+        rb->occupied[slot / 64] &= ~(1ULL << (slot % 64));
+    }
+}
+
+/* write all packets that are in-order */
+static void reorder_buffer_flush(struct reorder_buffer *rb) {
+    struct reorder_buffer_element *e = &rb->packets[(rb->sequence_flushed + 1) & (rb->capacity - 1)];
+    while ((e->packet) && (e->sequence == rb->sequence_flushed + 1)) {
+        logger(LOG_CRAZYDEBUG, "Reorder buffer: Packet %u arrived in-order.\n", e->sequence);
+        reorder_buffer_release(rb, ++rb->sequence_flushed);
+        e = &rb->packets[(rb->sequence_flushed + 1) & (rb->capacity - 1)];
+    }
+}
+
+/* distance from sequence_flushed to the next buffered packet, 0 if there is none within max */
+static uint32_t reorder_buffer_next(struct reorder_buffer *rb, uint32_t max) {
+    uint32_t distance = 1;
+    uint32_t slot;
+    uint64_t bits;
+    if (max > rb->capacity)
+        max = rb->capacity; /* everything beyond that can't be in the buffer */
+    while (distance <= max) {
+        slot = (rb->sequence_flushed + distance) & (rb->capacity - 1);
+        bits = rb->occupied[slot / 64] >> (slot % 64);
+        if (bits) {
+            distance += __builtin_ctzll(bits);
+            return (distance <= max) ? distance : 0;
+        }
+        distance += 64 - (slot % 64);
+    }
+    return 0;
+}
+
+/* move sequence_flushed up to sequence, writing buffered packets in-order on the way
+ * returns the number of missing packets that were given up on */
+static uint32_t reorder_buffer_advance(struct reorder_buffer *rb, uint32_t sequence) {
+    uint32_t remaining = sequence - rb->sequence_flushed;
+    uint32_t missing = 0;
+    uint32_t next;
+    while ((next = reorder_buffer_next(rb, remaining)) > 0) {
+        missing += next - 1;
+        remaining -= next;
+        rb->sequence_flushed += next;
+        reorder_buffer_release(rb, rb->sequence_flushed);
+    }
+    rb->sequence_flushed = sequence;
+    return missing + remaining;
+}
+
+/* give up on all missing packets up to and including sequence, writing the ones we have in-order */
+static void reorder_buffer_skip(struct reorder_buffer *rb, uint32_t sequence) {
+    runtime.stats.reorder_gaps += reorder_buffer_advance(rb, sequence);
+}
+
+/* start over at sequence, e.g. after the haap restarted its sequence numbers */
+static void reorder_buffer_resync(struct reorder_buffer *rb, uint32_t sequence) {
+    if (rb->synchronized) {
+        logger(LOG_DEBUG, "Reorder buffer: Resynchronizing from packet %u to %u.\n", rb->sequence_flushed + 1, sequence);
+        runtime.stats.reorder_resyncs++;
+        reorder_buffer_advance(rb, rb->sequence_flushed + rb->capacity);
+    }
+    rb->sequence_flushed = sequence - 1;
+    rb->synchronized = true;
+    rb->far_behind = 0;
+    rb->arrivals_count = 0;
+    rb->lte.active = false;
+    rb->dsl.active = false;
+}
+
+/* reorder only while both tunnels are up, gaps left by a tunnel that went down would never be filled */
+static void reorder_buffer_update_passthrough(struct reorder_buffer *rb) {
+    bool passthrough = (!runtime.lte.tunnel_established) || (!runtime.dsl.tunnel_established);
+    uint32_t next;
+    if (passthrough == rb->passthrough)
+        return;
+    rb->passthrough = passthrough;
+    if (!rb->synchronized)
+        return;
+
+    if (passthrough) {
+        logger(LOG_DEBUG, "Reorder buffer: Only one tunnel left, giving up on all missing packets.\n");
+        while ((next = reorder_buffer_next(rb, rb->capacity)) > 0) {
+            reorder_buffer_skip(rb, rb->sequence_flushed + next - 1);
+            reorder_buffer_flush(rb);
+        }
+    }
+    /* sequences seen in the meantime weren't tracked, start over with the next packet */
+    rb->synchronized = false;
+    rb->far_behind = 0;
+    rb->arrivals_count = 0;
+    rb->lte.active = false;
+    rb->dsl.active = false;
+}
+
+/* add packet to the reorder buffer, returns false if it was rejected and has to be returned to the pool by the caller
+ * link is the tunnel the packet arrived on, NULL if unknown
+ * delivered packets were written already and only advance the sequence once it gets to them */
+static bool reorder_buffer_insert(struct reorder_buffer *rb, struct reorder_buffer_link *link, uint32_t sequence, void *packet, uint16_t size, struct timeval arrival, bool delivered) {
+    if (!rb->synchronized) {
+        /* first packet, start right there */
+        reorder_buffer_resync(rb, sequence);
+    } else if (sequence_after(sequence, rb->sequence_flushed + rb->capacity)) {
+        /* too far ahead to fit, slide the window and give up on the oldest gaps, the slower tunnel may still fill the rest */
+        logger(LOG_DEBUG, "Reorder buffer: Packet %u doesn't fit into reorder buffer, skipping packets up to %u.\n", sequence, sequence - rb->capacity);
+        reorder_buffer_skip(rb, sequence - rb->capacity);
+        reorder_buffer_flush(rb);
+        rb->far_behind = 0;
+    } else if (!sequence_after(sequence, rb->sequence_flushed)) {
+        /* a run of packets far behind the window means the sequence started over */
+        if ((!sequence_after(sequence, rb->sequence_flushed - rb->capacity)) && (++rb->far_behind >= REORDER_BUFFER_RESYNC_THRESHOLD)) {
+            reorder_buffer_resync(rb, sequence);
+        } else {
+            logger(LOG_DEBUG, "Reorder buffer: Packet %u arrived after deadline of %" PRIu64 " ms. Discarding.\n", sequence, atomic_load_explicit(&runtime.reorder_buffer_timeout, memory_order_relaxed) / 1000);
+            runtime.stats.reorder_late++;
+            return false;
+        }
+    } else {
+        rb->far_behind = 0;
+    }
+
+    /* over the byte budget, give up on the oldest gaps to make room */
+    uint32_t next;
+    while ((runtime.reorder_buffer_bytes) && (!delivered) && (rb->bytes + size > runtime.reorder_buffer_bytes) && ((next = reorder_buffer_next(rb, sequence - rb->sequence_flushed - 1)) > 0)) {
+        logger(LOG_DEBUG, "Reorder buffer: Byte budget exceeded, giving up on packet %u.\n", rb->sequence_flushed + 1);
+        runtime.stats.reorder_overlimit++;
+        reorder_buffer_skip(rb, rb->sequence_flushed + next - 1);
+        reorder_buffer_flush(rb);
+    }
+
+    if ((link) && ((!link->active) || (sequence_after(sequence, link->sequence_highest)))) {
+        link->active = true;
+        link->sequence_highest = sequence;
+    }
+
+    uint32_t slot = sequence & (rb->capacity - 1);
+    struct reorder_buffer_element *e = &rb->packets[slot];
+    if (e->packet) {
+        logger(LOG_DEBUG, "Reorder buffer: Packet %u arrived twice. Discarding.\n", sequence);
+        runtime.stats.reorder_late++;
+        return false;
+    }
+    e->sequence = sequence;
+    e->packet = packet;
+    e->size = size;
+    e->timestamp = arrival;
+    e->delivered = delivered;
+    if (!delivered)
+        rb->bytes += size;
+    rb->occupied[slot / 64] |= 1ULL << (slot % 64);
+
+    /* the fifo can't overflow, all sequences in it are within twice the capacity of the oldest one */
+    struct reorder_buffer_arrival *a = &rb->arrivals[(rb->arrivals_head + rb->arrivals_count) & (rb->capacity * 2 - 1)];
+    a->sequence = sequence;
+    a->timestamp = arrival;
+    rb->arrivals_count++;
+
+    return true;
+}
+
+/* skip missing packets that both tunnels have already moved past, they are lost and waiting won't bring them back */
+static void reorder_buffer_infer_losses(struct reorder_buffer *rb) {
+    /* an idle tunnel says nothing about losses, stop tracking it before its sequence wraps around */
+    if ((rb->lte.active) && (sequence_after(rb->sequence_flushed - rb->capacity, rb->lte.sequence_highest)))
+        rb->lte.active = false;
+    if ((rb->dsl.active) && (sequence_after(rb->sequence_flushed - rb->capacity, rb->dsl.sequence_highest)))
+        rb->dsl.active = false;
+    if ((!rb->lte.active) || (!rb->dsl.active))
+        return;
+
+    uint32_t sequence = rb->lte.sequence_highest;
+    if (sequence_after(sequence, rb->dsl.sequence_highest))
+        sequence = rb->dsl.sequence_highest;
+
+    if (sequence_after(sequence, rb->sequence_flushed)) {
+        logger(LOG_DEBUG, "Reorder buffer: Both tunnels moved past packet %u, considering it lost.\n", rb->sequence_flushed + 1);
+        reorder_buffer_skip(rb, sequence);
+        reorder_buffer_flush(rb);
+    }
+}
+
+/* skip missing packets if packets after them have waited for too long */
+static void reorder_buffer_timeout(struct reorder_buffer *rb, struct timeval now) {
+    struct reorder_buffer_arrival *a;
+    struct timeval age;
+    uint64_t timeout = atomic_load_explicit(&runtime.reorder_buffer_timeout, memory_order_relaxed);
+    while (rb->arrivals_count > 0) {
+        a = &rb->arrivals[rb->arrivals_head];
+        if (sequence_after(a->sequence, rb->sequence_flushed)) {
+            timersub(&now, &a->timestamp, &age);
+            if ((uint64_t)age.tv_sec * 1000000 + age.tv_usec < timeout)
+                break;
+            logger(LOG_DEBUG, "Reorder buffer: Packet %u timed out while waiting for packet %u to arrive.\n", a->sequence, rb->sequence_flushed + 1);
+            reorder_buffer_skip(rb, a->sequence - 1);
+            reorder_buffer_flush(rb);
+        }
+        /* packet was written, drop it from the fifo */
+        rb->arrivals_head = (rb->arrivals_head + 1) & (rb->capacity * 2 - 1);
+        rb->arrivals_count--;
+    }
+}
+
+/* time at which the oldest buffered packet times out, false if the buffer is empty */
+static bool reorder_buffer_deadline(struct reorder_buffer *rb, struct timeval *deadline) {
+    if (rb->arrivals_count == 0)
+        return false;
+    uint64_t usec = atomic_load_explicit(&runtime.reorder_buffer_timeout, memory_order_relaxed);
+    struct timeval timeout = { .tv_sec = usec / 1000000, .tv_usec = usec % 1000000 };
+    timeradd(&rb->arrivals[rb->arrivals_head].timestamp, &timeout, deadline);
+    return true;
+}
+
+static void reorder_buffer_destroy(void *arg) {
+    struct reorder_buffer *rb = (struct reorder_buffer *)arg;
+    free(rb->packets);
+    free(rb->occupied);
+    free(rb->arrivals);
+    pool_destroy(rb->pool);
+}
+
+/* hand a gre packet received from the haap to the reorder buffer, or straight to the tun device
+ * returns true if the slot the packet is in was taken over, pooled is false for packets outside of the pool */
+static bool gre2tun_receive(struct reorder_buffer *rb, struct reorder_buffer_link *link, unsigned char *buffer, uint16_t size, struct timeval arrival, bool pooled) {
+    uint32_t sequence = 0;
+    uint8_t payload_offset;
+
+    /* extract sequence number and payload offset */
+    struct grehdr *greh = (struct grehdr *)buffer;
+    if ((size >= 12) && (greh->flags_and_version == htons(GRECP_FLAGSANDVERSION_WITH_SEQ))) {
+        memcpy(&sequence, buffer + sizeof(struct grehdr), sizeof(sequence));
+        sequence = ntohl(sequence);
+        payload_offset = 12;
+
+        if ((runtime.sequence_soak_test) && (!rb->sequence_offset_set)) {
+            rb->sequence_offset = SEQUENCE_SOAK_TEST_START - sequence;
+            rb->sequence_offset_set = true;
+        }
+        sequence += rb->sequence_offset;
+    } else if ((size >= 8) && (greh->flags_and_version == htons(GRECP_FLAGSANDVERSION))) {
+        payload_offset = 8;
+    } else {
+        logger(LOG_ERROR, "Received packet with invalid gre flags.\n");
+        return false;
+    }
+
+    if ((payload_offset == 8) || (rb->passthrough) || (atomic_load_explicit(&runtime.reorder_buffer_timeout, memory_order_relaxed) == 0)) {
+        /* no sequence, single tunnel or reordering diabled? flush directly */
+        if (!pooled) {
+            tun_write(sockfd_tun, buffer + payload_offset, size - payload_offset);
+            return false;
+        }
+        tun_output_write(rb->output, buffer + payload_offset, size - payload_offset);
+        return true;
+    } else if ((runtime.reorder_buffer_bypass.enabled) && (reorder_buffer_bypass(buffer + payload_offset, size - payload_offset))) {
+        /* no need to wait, the reorder buffer only keeps track of its sequence, but late and duplicate packets are still dropped */
+        if (!reorder_buffer_insert(rb, link, sequence, buffer + payload_offset, size - payload_offset, arrival, true))
+            return false;
+        runtime.stats.reorder_bypassed++;
+        if (!pooled) {
+            tun_write(sockfd_tun, buffer + payload_offset, size - payload_offset);
+            return false;
+        }
+        tun_output_write(rb->output, buffer + payload_offset, size - payload_offset);
+        return true;
+    } else if (!pooled) {
+        runtime.stats.reorder_pool_exhausted++;
+        logger(LOG_DEBUG, "Reorder buffer: Packet pool exhausted, discarding packet %u.\n", sequence);
+        return false;
+    }
+    /* slot is owned by the reorder buffer now, unless it was rejected */
+    return reorder_buffer_insert(rb, link, sequence, buffer + payload_offset, size - payload_offset, arrival, false);
+}
+
+/* raw socket or io_uring, timer, tunnel state and af_xdp or packet sockets */
+#define GRE2TUN_MAX_EVENTS (3 + 2 * XDP_MAX_QUEUES)
+
+/* control messages of packets received on the raw socket, destination address and kernel timestamp */
+#define GRE2TUN_CONTROL_SIZE (CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(struct timespec)))
+
+struct receive_batch {
+    struct mmsghdr *msgs;
+    struct iovec *iovecs;
+    struct sockaddr_in6 *saddrs;
+    unsigned char (*controls)[GRE2TUN_CONTROL_SIZE];
+    unsigned char **buffers;
+};
+
+/* multishot receive on the raw socket, into pool slots provided to the kernel up front
+ * each packet is preceded by a header, its source address and control messages, all kept aligned */
+#define GRE2TUN_URING_BUFFERS 256
+#define GRE2TUN_URING_NAME_SIZE CMSG_ALIGN(sizeof(struct sockaddr_in6))
+#define GRE2TUN_URING_SLOT_SIZE (sizeof(struct io_uring_recvmsg_out) + GRE2TUN_URING_NAME_SIZE + GRE2TUN_CONTROL_SIZE + MAX_PKT_SIZE)
+
+struct gre2tun_uring {
+    struct uring ring;
+    /* tells the kernel how much room to leave for source address and control messages */
+    struct msghdr msg;
+    bool armed;
+    /* keeps the socket drained if the pool is exhausted, just like with recvmmsg */
+    unsigned char fallback_buffer[GRE2TUN_URING_SLOT_SIZE];
+};
+
+static void close_fd(void *arg) {
+    close(*(int *)arg);
+}
+
+static void receive_batch_destroy(void *arg) {
+    struct receive_batch *batch = (struct receive_batch *)arg;
+    free(batch->msgs);
+    free(batch->iovecs);
+    free(batch->saddrs);
+    free(batch->controls);
+    free(batch->buffers);
+}
+
+/* kernel receive timestamps are wall clock time, turn them into uptime with the offset taken for the batch */
+static struct timeval gre2tun_arrival(struct timespec *timestamp, struct timeval now, struct timeval realtime_offset) {
+    struct timeval arrival = { .tv_sec = timestamp->tv_sec, .tv_usec = timestamp->tv_nsec / 1000 };
+    timersub(&arrival, &realtime_offset, &arrival);
+    /* the wall clock may have been stepped since, either way
+     * a packet can't have been waiting in the socket for longer than any reorder buffer timeout */
+    uint64_t usec = atomic_load_explicit(&runtime.reorder_buffer_timeout, memory_order_relaxed);
+    struct timeval oldest = { .tv_sec = usec / 1000000, .tv_usec = usec % 1000000 };
+    if (timercmp(&oldest, &runtime.reorder_buffer_timeout_max, <))
+        oldest = runtime.reorder_buffer_timeout_max;
+    timersub(&now, &oldest, &oldest);
+    if ((timercmp(&arrival, &now, <)) && (!timercmp(&arrival, &oldest, <)))
+        return arrival;
+    return now;
+}
+
+/* determine tunnel by the address the packet was sent to, and when it arrived */
+static struct reorder_buffer_link *gre2tun_control(struct reorder_buffer *rb, struct msghdr *msg, struct timeval realtime_offset, struct timeval *arrival) {
+    struct reorder_buffer_link *link = NULL;
+    struct in6_pktinfo *pi;
+    struct timespec timestamp;
+    struct cmsghdr *c;
+    *arrival = rb->now;
+    for (c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+        if ((c->cmsg_level == IPPROTO_IPV6) && (c->cmsg_type == IPV6_PKTINFO)) {
+            pi = (struct in6_pktinfo *)CMSG_DATA(c);
+            if (memcmp(&pi->ipi6_addr, &runtime.lte.interface_ip, sizeof(struct in6_addr)) == 0)
+                link = &rb->lte;
+            else if (memcmp(&pi->ipi6_addr, &runtime.dsl.interface_ip, sizeof(struct in6_addr)) == 0)
+                link = &rb->dsl;
+        } else if ((c->cmsg_level == SOL_SOCKET) && (c->cmsg_type == SCM_TIMESTAMPNS)) {
+            memcpy(&timestamp, CMSG_DATA(c), sizeof(timestamp));
+            *arrival = gre2tun_arrival(&timestamp, rb->now, realtime_offset);
+        }
+    }
+    return link;
+}
+
+/* keep the kernel supplied with pool slots, but leave a receive batch worth for the others */
+static void gre2tun_uring_refill(struct gre2tun_uring *u, struct packet_pool *pool) {
+    while ((u->ring.buffer_count < GRE2TUN_URING_BUFFERS) && (pool->free_count > runtime.receive_batch_size))
+        uring_buffer_provide(&u->ring, pool_get(pool), pool->slot_size);
+    if (u->ring.buffer_count == 0)
+        uring_buffer_provide(&u->ring, u->fallback_buffer, GRE2TUN_URING_SLOT_SIZE);
+}
+
+/* multishot receives keep going until the kernel runs out of buffers or ends them, then they are armed again */
+static bool gre2tun_uring_arm(struct gre2tun_uring *u) {
+    struct io_uring_sqe *sqe = uring_sqe(&u->ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->addr = (uintptr_t)&u->msg;
+    sqe->buf_group = 0;
+    if (uring_submit(&u->ring, 0) < 0) {
+        logger(LOG_ERROR, "Raw socket receive submission failed: %s\n", strerror(errno));
+        return false;
+    }
+    u->armed = true;
+    return true;
+}
+
+/* requires linux 6.0 or newer */
+static bool gre2tun_uring_open(struct gre2tun_uring *u, struct packet_pool *pool) {
+    u->msg.msg_namelen = GRE2TUN_URING_NAME_SIZE;
+    u->msg.msg_controllen = GRE2TUN_CONTROL_SIZE;
+    if ((!uring_open(&u->ring, 8)) || (!uring_register_files(&u->ring, &sockfd_gre, 1)) || (!uring_buffers_create(&u->ring, GRE2TUN_URING_BUFFERS)))
+        return false;
+    if (!gre2tun_uring_arm(u))
+        return false;
+
+    /* older kernels reject multishot receives right away, nothing is taken from the pool before */
+    struct io_uring_cqe *cqe = uring_cqe(&u->ring);
+    if ((cqe) && (cqe->res == -EINVAL)) {
+        logger(LOG_ERROR, "Multishot receive on raw socket not supported by the kernel.\n");
+        return false;
+    }
+    gre2tun_uring_refill(u, pool);
+    return true;
+}
+
+static void gre2tun_uring_close(void *arg) {
+    struct gre2tun_uring *u = (struct gre2tun_uring *)arg;
+    uring_close(&u->ring);
+}
+
+/* packets received by the multishot receive, nothing is copied and there's no system call per batch */
+static void gre2tun_receive_uring(struct reorder_buffer *rb, struct gre2tun_uring *u, struct timeval realtime_offset) {
+    struct io_uring_cqe *cqe;
+    struct io_uring_recvmsg_out *out;
+    struct sockaddr_in6 *saddr;
+    struct reorder_buffer_link *link;
+    struct timeval arrival;
+    struct msghdr msg = {};
+    unsigned char *buffer;
+    if (u->ring.fd < 0)
+        return;
+    while ((cqe = uring_cqe(&u->ring)) != NULL) {
+        buffer = uring_buffer_take(&u->ring, cqe->flags);
+        /* ran out of buffers, failed or was ended by the kernel, needs to be armed again */
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            u->armed = false;
+        if ((cqe->res < 0) && (cqe->res != -ENOBUFS))
+            logger(LOG_ERROR, "Raw socket receive failed: %s\n", strerror(-cqe->res));
+        uring_cqe_seen(&u->ring);
+        if (!buffer)
+            continue;
+
+        /* ignore truncated packets and those with invalid source ips */
+        out = (struct io_uring_recvmsg_out *)buffer;
+        saddr = (struct sockaddr_in6 *)(out + 1);
+        if ((out->flags & MSG_TRUNC) || (out->namelen < sizeof(struct sockaddr_in6)) || (memcmp(&saddr->sin6_addr, &runtime.haap.ip, sizeof(struct in6_addr)) != 0)) {
+            if (buffer != u->fallback_buffer)
+                pool_put(rb->pool, buffer);
+            continue;
+        }
+        msg.msg_control = (unsigned char *)saddr + GRE2TUN_URING_NAME_SIZE;
+        msg.msg_controllen = out->controllen;
+        link = gre2tun_control(rb, &msg, realtime_offset, &arrival);
+
+        if ((!gre2tun_receive(rb, link, (unsigned char *)saddr + GRE2TUN_URING_NAME_SIZE + GRE2TUN_CONTROL_SIZE, out->payloadlen, arrival, buffer != u->fallback_buffer)) && (buffer != u->fallback_buffer))
+            pool_put(rb->pool, buffer);
+    }
+    gre2tun_uring_refill(u, rb->pool);
+    if (!u->armed)
+        gre2tun_uring_arm(u);
+}
+
+/* af_xdp frames, the tunnel is known by the interface they arrived on
+ * there are no kernel timestamps, but they are picked up right away */
+static void gre2tun_receive_xdp(struct reorder_buffer *rb, struct xdp *xdp) {
+    struct xdp_socket *s;
+    struct reorder_buffer_link *link;
+    struct ip6_hdr *ip6h;
+    unsigned char *buffer;
+    uint16_t size;
+    uint32_t received;
+    for (int j=0; j<xdp->count; j++) {
+        s = &xdp->sockets[j];
+        link = (s->tuntype == GRECP_TUNTYPE_LTE) ? &rb->lte : &rb->dsl;
+        received = xdp_peek(s, runtime.receive_batch_size);
+        for (int i=0; i<received; i++) {
+            buffer = xdp_frame(s, i, &size);
+            ip6h = (struct ip6_hdr *)buffer;
+
+            /* ignore packets with invalid source ips, and the link layer padding of short ones */
+            if ((size < sizeof(struct ip6_hdr)) || (memcmp(&ip6h->ip6_src, &runtime.haap.ip, sizeof(struct in6_addr)) != 0) ||
+                (ntohs(ip6h->ip6_plen) > size - sizeof(struct ip6_hdr))) {
+                pool_put(rb->pool, buffer);
                 continue;
             }
+            if (!gre2tun_receive(rb, link, buffer + sizeof(struct ip6_hdr), ntohs(ip6h->ip6_plen), rb->now, true))
+                pool_put(rb->pool, buffer);
+        }
+        xdp_consume(xdp, s, received);
+    }
+    xdp_refill(xdp);
+}
+
+/* packet socket frames are copied into pool slots, so the kernel gets its blocks back right away */
+static void gre2tun_receive_tpacket(struct reorder_buffer *rb, struct tpacket *tpacket, struct timeval realtime_offset, unsigned char *fallback_buffer) {
+    struct tpacket_socket *s;
+    struct tpacket_block_desc *block;
+    struct tpacket3_hdr *frame;
+    struct reorder_buffer_link *link;
+    struct ip6_hdr *ip6h;
+    struct timespec timestamp;
+    unsigned char *buffer;
+    uint16_t size;
+    for (int j=0; j<tpacket->count; j++) {
+        s = &tpacket->sockets[j];
+        link = (s->tuntype == GRECP_TUNTYPE_LTE) ? &rb->lte : &rb->dsl;
+        while ((block = tpacket_block(s)) != NULL) {
+            frame = (struct tpacket3_hdr *)((unsigned char *)block + block->hdr.bh1.offset_to_first_pkt);
+            for (uint32_t i=0; i<block->hdr.bh1.num_pkts; i++) {
+                ip6h = (struct ip6_hdr *)((unsigned char *)frame + frame->tp_net);
+                size = ntohs(ip6h->ip6_plen);
 
-            if ((payload_offset == 8) || ((runtime.reorder_buffer_timeout.tv_sec == 0) && (runtime.reorder_buffer_timeout.tv_usec == 0))) {
-                /* no sequence or reordering diabled? flush directly */
-                if (write(sockfd_tun, buffer + payload_offset, size - payload_offset) != size - payload_offset) {
-                    logger(LOG_ERROR, "Tun device write failed: %s\n", strerror(errno));
+                /* ignore packets with invalid source ips, and anything the raw socket would have truncated */
+                if ((frame->tp_snaplen >= sizeof(struct ip6_hdr)) && (memcmp(&ip6h->ip6_src, &runtime.haap.ip, sizeof(struct in6_addr)) == 0) &&
+                    (size <= frame->tp_snaplen - sizeof(struct ip6_hdr)) && (size <= MAX_PKT_SIZE)) {
+                    if ((buffer = pool_get(rb->pool)) == NULL)
+                        buffer = fallback_buffer;
+                    memcpy(buffer, ip6h + 1, size);
+                    timestamp.tv_sec = frame->tp_sec;
+                    timestamp.tv_nsec = frame->tp_nsec;
+                    if ((!gre2tun_receive(rb, link, buffer, size, gre2tun_arrival(&timestamp, rb->now, realtime_offset), buffer != fallback_buffer)) && (buffer != fallback_buffer))
+                        pool_put(rb->pool, buffer);
                 }
-            } else {
-                /* add packet to reorder buffer */
-                reorder_buffer.packets = realloc(reorder_buffer.packets, sizeof(struct reorder_buffer_element) * (reorder_buffer.size + 1));
-                reorder_buffer.packets[reorder_buffer.size].sequence = sequence;
-                reorder_buffer.packets[reorder_buffer.size].timestamp = get_uptime();
-                reorder_buffer.packets[reorder_buffer.size].size = size - payload_offset;
-                reorder_buffer.packets[reorder_buffer.size].packet = malloc(reorder_buffer.packets[reorder_buffer.size].size);
-                memcpy(reorder_buffer.packets[reorder_buffer.size].packet, buffer + payload_offset, reorder_buffer.packets[reorder_buffer.size].size);
-                reorder_buffer.size++;
+                frame = (struct tpacket3_hdr *)((unsigned char *)frame + frame->tp_next_offset);
             }
+            tpacket_block_release(s, block);
         }
+    }
+}
 
-        now = get_uptime();
+void *gre2tun_main() {
+    char threadname[IF_NAMESIZE];
+    snprintf(threadname, sizeof(threadname), "%.9s-recv", runtime.tunnel_interface_name);
+    pthread_setname_np(pthread_self(), threadname);
 
-        /* flush reorder buffer, in-order */
-        restartflushing:
-        flushed_something = true;
-        while (flushed_something) {
-            flushed_something = false;
-            for (int i=0; i<reorder_buffer.size; i++) {
-                if (reorder_buffer.packets[i].sequence == sequence_flushed +1) {
-                    logger(LOG_CRAZYDEBUG, "Reorder buffer: Packet %u arrived in-order.\n", reorder_buffer.packets[i].sequence);
-                    if (write(sockfd_tun, reorder_buffer.packets[i].packet, reorder_buffer.packets[i].size) != reorder_buffer.packets[i].size) {
-                        logger(LOG_ERROR, "Tun device write failed: %s\n", strerror(errno));
-                    }
-                    free(reorder_buffer.packets[i].packet);
-                    flushed_something = true;
-                    sequence_flushed++;
-                    reorder_buffer.packets[i].size = 0; /* mark as flushed */
+    /* one slot per reorder buffer element plus one per packet of a receive batch, tun device writer queue, coalesced segment,
+     * af_xdp fill ring and io_uring buffer, af_xdp frames and io_uring buffers are pool slots so they need to be larger */
+    struct packet_pool pool = {};
+    struct tun_output output = {
+        .pool = &pool,
+    };
+    struct reorder_buffer reorder_buffer = {
+        .capacity = runtime.reorder_buffer_size,
+        .pool = &pool,
+        .output = &output,
+    };
+    reorder_buffer.packets = calloc(reorder_buffer.capacity, sizeof(struct reorder_buffer_element));
+    reorder_buffer.occupied = calloc(reorder_buffer.capacity / 64, sizeof(uint64_t));
+    reorder_buffer.arrivals = calloc(reorder_buffer.capacity * 2, sizeof(struct reorder_buffer_arrival));
+    if ((!reorder_buffer.packets) || (!reorder_buffer.occupied) || (!reorder_buffer.arrivals))
+        logger(LOG_FATAL, "Allocating reorder buffer failed.\n");
+    if (!pool_create(&pool, reorder_buffer.capacity + runtime.receive_batch_size + (runtime.tunnel_queues > 1 ? runtime.tunnel_queues * TUN_WRITER_QUEUE_SIZE : 0) + (runtime.tunnel_offload ? runtime.tunnel_queues * GRO_MAX_SEGMENTS : 0) +
+                (runtime.receive_backend == RECEIVE_BACKEND_XDP ? xdp_max_sockets() * XDP_RING_SIZE : 0) + (runtime.io_uring ? GRE2TUN_URING_BUFFERS + TUN_WRITER_URING_SIZE : 0),
+                (runtime.receive_backend == RECEIVE_BACKEND_XDP) ? XDP_FRAME_SIZE : (runtime.io_uring ? GRE2TUN_URING_SLOT_SIZE : MAX_PKT_SIZE)))
+        logger(LOG_FATAL, "Allocating packet pool failed.\n");
+    pthread_cleanup_push(reorder_buffer_destroy, &reorder_buffer);
+
+    tun_output_start(&output);
+    pthread_cleanup_push(tun_output_stop, &output);
+    /* with a single queue, the receiver's tun device writes are submitted together */
+    if ((runtime.io_uring) && (output.count == 0) && (!tun_writer_uring_open(&output.writers[0])))
+        logger(LOG_ERROR, "Setting up io_uring for tun device writes failed, writing one packet at a time.\n");
+    pthread_cleanup_push(tun_writer_uring_close, &output.writers[0]);
+
+    struct receive_batch batch = {};
+    batch.msgs = calloc(runtime.receive_batch_size, sizeof(struct mmsghdr));
+    batch.iovecs = calloc(runtime.receive_batch_size, sizeof(struct iovec));
+    batch.saddrs = calloc(runtime.receive_batch_size, sizeof(struct sockaddr_in6));
+    batch.controls = calloc(runtime.receive_batch_size, sizeof(*batch.controls));
+    batch.buffers = calloc(runtime.receive_batch_size, sizeof(unsigned char *));
+    if ((!batch.msgs) || (!batch.iovecs) || (!batch.saddrs) || (!batch.controls) || (!batch.buffers))
+        logger(LOG_FATAL, "Allocating receive batch failed.\n");
+    pthread_cleanup_push(receive_batch_destroy, &batch);
+
+    /* gre packets of the haap bypass the ipv6 stack, anything else still arrives on the raw socket */
+    struct xdp xdp = {};
+    if ((runtime.receive_backend == RECEIVE_BACKEND_XDP) && (!xdp_open(&xdp, &pool)))
+        logger(LOG_ERROR, "Setting up XDP failed, receiving via raw socket only.\n");
+    pthread_cleanup_push(xdp_close, &xdp);
+    struct tpacket tpacket = {};
+    if ((runtime.receive_backend == RECEIVE_BACKEND_TPACKET) && (!tpacket_open(&tpacket)))
+        logger(LOG_ERROR, "Setting up packet sockets failed, receiving via raw socket only.\n");
+    pthread_cleanup_push(tpacket_close, &tpacket);
+    struct gre2tun_uring uring = {
+        .ring.fd = -1,
+    };
+    if ((runtime.io_uring) && (!gre2tun_uring_open(&uring, &pool))) {
+        logger(LOG_ERROR, "Setting up io_uring for raw socket receives failed, falling back to recvmmsg.\n");
+        uring_close(&uring.ring);
+    }
+    pthread_cleanup_push(gre2tun_uring_close, &uring);
+
+    /* sleep until packets arrive or the oldest buffered packet times out, an idle tunnel costs no wakeups */
+    int epollfd = epoll_create1(0);
+    pthread_cleanup_push(close_fd, &epollfd);
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+    pthread_cleanup_push(close_fd, &timerfd);
+    struct epoll_event event = { .events = EPOLLIN };
+    if (uring.ring.fd < 0) {
+        event.data.fd = sockfd_gre;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd_gre, &event) < 0) {
+            logger(LOG_ERROR, "Adding raw socket to epoll failed: %s\n", strerror(errno));
+        }
+    } else {
+        /* readable once there are completions */
+        event.data.fd = uring.ring.fd;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, uring.ring.fd, &event) < 0) {
+            logger(LOG_ERROR, "Adding io_uring to epoll failed: %s\n", strerror(errno));
+        }
+    }
+    event.data.fd = timerfd;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, timerfd, &event) < 0) {
+        logger(LOG_ERROR, "Adding reorder buffer timer to epoll failed: %s\n", strerror(errno));
+    }
+    event.data.fd = eventfd_tunnel_state;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, eventfd_tunnel_state, &event) < 0) {
+        logger(LOG_ERROR, "Adding tunnel state eventfd to epoll failed: %s\n", strerror(errno));
+    }
+    for (int i=0; i<xdp.count; i++) {
+        event.data.fd = xdp.sockets[i].fd;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, xdp.sockets[i].fd, &event) < 0) {
+            logger(LOG_ERROR, "Adding AF_XDP socket to epoll failed: %s\n", strerror(errno));
+        }
+    }
+    for (int i=0; i<tpacket.count; i++) {
+        event.data.fd = tpacket.sockets[i].fd;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, tpacket.sockets[i].fd, &event) < 0) {
+            logger(LOG_ERROR, "Adding packet socket to epoll failed: %s\n", strerror(errno));
+        }
+    }
+    struct epoll_event events[GRE2TUN_MAX_EVENTS];
+    eventfd_t tunnel_state_changes;
+    int nevents;
+    bool readable = false;
+    uint64_t expirations;
+    struct timeval deadline;
+    struct timeval deadline_armed = {};
+    struct itimerspec timer = {};
+
+    unsigned char fallback_buffer[MAX_PKT_SIZE];
+    unsigned char *buffer;
+    int received;
+    int vlen;
+    ssize_t size;
+    struct reorder_buffer_link *link;
+
+    struct timeval now;
+    struct timeval arrival;
+    struct timespec realtime;
+    struct timeval realtime_offset;
+
+    while (true) {
+        /* a full batch means there's probably more queued, receive again without waiting */
+        if (!readable) {
+            nevents = epoll_wait(epollfd, events, GRE2TUN_MAX_EVENTS, -1);
+            if (nevents < 0) {
+                if (errno != EINTR)
+                    logger(LOG_ERROR, "Waiting for raw socket failed: %s\n", strerror(errno));
+                continue;
+            }
+            for (int i=0; i<nevents; i++) {
+                if (events[i].data.fd == timerfd) {
+                    if (read(timerfd, &expirations, sizeof(expirations)) < 0)
+                        logger(LOG_ERROR, "Reading reorder buffer timer failed: %s\n", strerror(errno));
+                    timerclear(&deadline_armed);
+                } else if (events[i].data.fd == eventfd_tunnel_state) {
+                    eventfd_read(eventfd_tunnel_state, &tunnel_state_changes);
+                } else if (events[i].data.fd == sockfd_gre) {
+                    readable = true;
+                } else if (events[i].data.fd == uring.ring.fd) {
+                    uring_complete(&uring.ring);
                 }
+                /* io_uring, af_xdp and packet socket rings are looked at every time anyway */
             }
         }
 
-        /* check for timed-out packets */
-        for (int i=0; i<reorder_buffer.size; i++) {
-            if (reorder_buffer.packets[i].size > 0) {
-                timersub(&now, &reorder_buffer.packets[i].timestamp, &age);
-                if (timercmp(&age, &runtime.reorder_buffer_timeout, >=)) {
-                    logger(LOG_DEBUG, "Reorder buffer: Packet %u timed out while waiting for packet %u to arrive.\n", reorder_buffer.packets[i].sequence, sequence_flushed + 1);
-                    sequence_flushed++;
-                    goto restartflushing;
-                }
+        /* receive straight into pool slots, buffered packets never get copied */
+        tun_output_reclaim(&output);
+        vlen = 0;
+        while (vlen < runtime.receive_batch_size) {
+            if ((!batch.buffers[vlen]) || (batch.buffers[vlen] == fallback_buffer))
+                batch.buffers[vlen] = pool_get(&pool);
+            if (!batch.buffers[vlen]) {
+                /* pool exhausted, keep draining the socket anyway */
+                if (vlen == 0)
+                    batch.buffers[vlen++] = fallback_buffer;
+                break;
             }
+            vlen++;
         }
+        for (int i=0; i<vlen; i++) {
+            batch.iovecs[i].iov_base = batch.buffers[i];
+            batch.iovecs[i].iov_len = MAX_PKT_SIZE;
+            batch.msgs[i].msg_hdr.msg_iov = &batch.iovecs[i];
+            batch.msgs[i].msg_hdr.msg_iovlen = 1;
+            batch.msgs[i].msg_hdr.msg_name = &batch.saddrs[i];
+            batch.msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+            batch.msgs[i].msg_hdr.msg_control = batch.controls[i];
+            batch.msgs[i].msg_hdr.msg_controllen = sizeof(*batch.controls);
+        }
+
+        /* take whatever is queued, the loop must never block here or reorder buffer timeouts would be late */
+        received = 0;
+        if (readable) {
+            received = recvmmsg(sockfd_gre, batch.msgs, vlen, MSG_WAITFORONE | MSG_DONTWAIT, NULL);
 
-        /* and drop packets arriving after the deadline */
-        for (int i=0; i<reorder_buffer.size; i++) {
-            if ((reorder_buffer.packets[i].size > 0) && (reorder_buffer.packets[i].sequence <= sequence_flushed)) {
-                logger(LOG_DEBUG, "Reorder buffer: Packet %u arrived after deadline of %u.%03u seconds. Discarding.\n", reorder_buffer.packets[i].sequence, runtime.reorder_buffer_timeout.tv_sec, runtime.reorder_buffer_timeout.tv_usec / 1000);
-                free(reorder_buffer.packets[i].packet);
-                reorder_buffer.packets[i].size = 0; /* mark as flushed */
+            if (received < 0) {
+                if ((errno != EAGAIN) && (errno != EINTR))
+                    logger(LOG_ERROR, "Raw socket receive failed: %s\n", strerror(errno));
+                received = 0;
             }
+            readable = (received == vlen);
         }
 
-        /* remove flushed packets from reorder buffer */
-        reorder_buffer_freeable = 0;
-        for (int i=0; i<reorder_buffer.size; i++) {
-            if (reorder_buffer.packets[i].size == 0)
-                reorder_buffer_freeable++;
-            else
-                break;
+        /* clocks are read once per batch, packets are aged by the kernel receive timestamp
+         * which is wall clock time, so keep the offset to the monotonic clock around */
+        now = get_uptime();
+        reorder_buffer.now = now;
+        reorder_buffer_update_passthrough(&reorder_buffer);
+        clock_gettime(CLOCK_REALTIME, &realtime);
+        realtime_offset.tv_sec = realtime.tv_sec;
+        realtime_offset.tv_usec = realtime.tv_nsec / 1000;
+        timersub(&realtime_offset, &now, &realtime_offset);
+
+        for (int i=0; i<received; i++) {
+            buffer = batch.buffers[i];
+            size = batch.msgs[i].msg_len;
+
+            /* ignore packets with invalid source ips */
+            if (memcmp(&batch.saddrs[i].sin6_addr, &runtime.haap.ip, sizeof(struct in6_addr)) != 0) {
+                continue;
+            }
+
+            link = gre2tun_control(&reorder_buffer, &batch.msgs[i].msg_hdr, realtime_offset, &arrival);
+            if (gre2tun_receive(&reorder_buffer, link, buffer, size, arrival, buffer != fallback_buffer))
+                batch.buffers[i] = NULL;
         }
-        if (reorder_buffer.size == reorder_buffer_freeable) {
-            reorder_buffer.packets = realloc(reorder_buffer.packets, 0);
-            reorder_buffer.size = 0;
-        } else if (reorder_buffer_freeable > 0) {
-            reorder_buffer.packets_old = reorder_buffer.packets;
-            reorder_buffer.packets = malloc(sizeof(struct reorder_buffer_element) * (reorder_buffer.size - reorder_buffer_freeable));
-            memcpy(reorder_buffer.packets, reorder_buffer.packets_old + reorder_buffer_freeable, sizeof(struct reorder_buffer_element) * (reorder_buffer.size - reorder_buffer_freeable));
-            free(reorder_buffer.packets_old);
-            reorder_buffer.size -= reorder_buffer_freeable;
+
+        gre2tun_receive_uring(&reorder_buffer, &uring, realtime_offset);
+        gre2tun_receive_xdp(&reorder_buffer, &xdp);
+        gre2tun_receive_tpacket(&reorder_buffer, &tpacket, realtime_offset, fallback_buffer);
+
+        /* flush reorder buffer, in-order */
+        reorder_buffer_flush(&reorder_buffer);
+
+        /* skip packets known to be lost */
+        reorder_buffer_infer_losses(&reorder_buffer);
+
+        /* check for timed-out packets */
+        reorder_buffer_timeout(&reorder_buffer, now);
+
+        tun_output_wakeup(&output);
+
+        /* wake up again when the oldest packet still buffered times out */
+        if (!reorder_buffer_deadline(&reorder_buffer, &deadline))
+            timerclear(&deadline);
+        if (timercmp(&deadline, &deadline_armed, !=)) {
+            timer.it_value.tv_sec = deadline.tv_sec;
+            timer.it_value.tv_nsec = deadline.tv_usec * 1000;
+            if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &timer, NULL) < 0)
+                logger(LOG_ERROR, "Arming reorder buffer timer failed: %s\n", strerror(errno));
+            deadline_armed = deadline;
         }
     }
 
-    /* TODO: fix memory leak on thread cancel */
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
 }
\ No newline at end of file
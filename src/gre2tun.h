@@ -14,4 +14,6 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-void *gre2tun_main();
\ No newline at end of file
+void *gre2tun_main();
+void update_reorder_buffer_timeout();
+void update_tunnel_state();
\ No newline at end of file
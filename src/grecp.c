@@ -93,24 +93,18 @@ void process_grecpmessage(void *buffer, int size) {
 }
 
 bool send_grecpmessage(uint8_t msgtype, uint8_t tuntype, void *attributes, int attributes_size) {
-    unsigned char buffer[MAX_PKT_SIZE] = {};
-    int size = 0;
+    struct {
+        struct grehdr gre;
+        struct grecphdr grecp;
+    } __attribute__((packed)) header = {};
 
     /* GRE header */
-    struct grehdr *greh = (struct grehdr *)(buffer + size);
-    greh->flags_and_version = htons(GRECP_FLAGSANDVERSION);
-    greh->proto = htons(GRECP_PROTO);
-    greh->key = htonl(runtime.haap.bonding_key);
-    size += sizeof(struct grehdr);
+    header.gre.flags_and_version = htons(GRECP_FLAGSANDVERSION);
+    header.gre.proto = htons(GRECP_PROTO);
+    header.gre.key = htonl(runtime.haap.bonding_key);
 
     /* GRECP header */
-    struct grecphdr *grecph = (struct grecphdr *)(buffer + size);
-    grecph->msgtype_and_tuntype = (msgtype << 4) | tuntype;
-    size += sizeof(struct grecphdr);
-
-    /* Add GRECP attributes */
-    memcpy(buffer + size, attributes, attributes_size);
-    size += attributes_size;
+    header.grecp.msgtype_and_tuntype = (msgtype << 4) | tuntype;
 
     /* Source & Destination */
     struct sockaddr_in6 src = {};
@@ -126,7 +120,7 @@ bool send_grecpmessage(uint8_t msgtype, uint8_t tuntype, void *attributes, int a
 
     /* Construct control information */
     struct msghdr msgh = {};
-    struct iovec msgiov = {};
+    struct iovec msgiov[2] = {};
     struct cmsghdr *c;
     struct unp_in_pktinfo {
         struct in6_addr ipi6_addr;
@@ -134,10 +128,13 @@ bool send_grecpmessage(uint8_t msgtype, uint8_t tuntype, void *attributes, int a
     } *pi;
     msgh.msg_name = &dst;
     msgh.msg_namelen = sizeof(struct sockaddr_in6);
-    msgiov.iov_base = buffer;
-    msgiov.iov_len = size;
-    msgh.msg_iov = &msgiov;
-    msgh.msg_iovlen = 1;
+    /* headers and attributes are sent as they are, without copying them into a single buffer */
+    msgiov[0].iov_base = &header;
+    msgiov[0].iov_len = sizeof(header);
+    msgiov[1].iov_base = attributes;
+    msgiov[1].iov_len = attributes_size;
+    msgh.msg_iov = msgiov;
+    msgh.msg_iovlen = 2;
     unsigned char control_buf[CMSG_LEN(sizeof(struct unp_in_pktinfo))] = {};
     msgh.msg_control = &control_buf;
     msgh.msg_controllen = CMSG_LEN(sizeof(struct unp_in_pktinfo));
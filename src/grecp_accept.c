@@ -58,6 +58,14 @@ void handle_grecpaccept(uint8_t tuntype, void *buffer, int size) {
                 memcpy(&runtime.haap.bypass_bandwidth_check_interval, attr.value, attr.length);
                 runtime.haap.bypass_bandwidth_check_interval = ntohl(runtime.haap.bypass_bandwidth_check_interval);
                 break;
+            case GRECP_MSGATTR_CONFIGURED_DSL_UPSTREAM_BANDWIDTH:
+                if (attr.length != sizeof(runtime.haap.dsl_upstream_bandwidth)) {
+                    logger(LOG_DEBUG, "Invalid length of configured dsl upstream bandwidth in accept message received: %u\n", attr.length);
+                    break;
+                }
+                memcpy(&runtime.haap.dsl_upstream_bandwidth, attr.value, sizeof(runtime.haap.dsl_upstream_bandwidth));
+                runtime.haap.dsl_upstream_bandwidth = ntohl(runtime.haap.dsl_upstream_bandwidth);
+                break;
             case GRECP_MSGATTR_PADDING:
                 break;
             default:
@@ -66,6 +74,8 @@ void handle_grecpaccept(uint8_t tuntype, void *buffer, int size) {
         }
     }
 
+    update_socket_filters();
+
     /* TODO: verify if we really are good to go before setting these */
     if (tuntype == GRECP_TUNTYPE_LTE) {
         runtime.lte.tunnel_established = true;
@@ -83,15 +83,19 @@ void handle_grecphello(uint8_t tuntype, void *buffer, int size) {
 
                 if (tuntype == GRECP_TUNTYPE_LTE ) {
                     timersub(&now, &sent, &runtime.lte.round_trip_time);
+                    update_smoothed_round_trip_time(&runtime.lte.smoothed_round_trip_time, &runtime.lte.round_trip_time_variation, runtime.lte.round_trip_time);
                     runtime.lte.last_hello_received = timestamp.seconds;
                     runtime.lte.missed_hellos = 0;
                     logger(LOG_DEBUG, "Round trip time for LTE: %u.%03us\n", runtime.lte.round_trip_time.tv_sec, runtime.lte.round_trip_time.tv_usec / 1000);
                 } else {
                     timersub(&now, &sent, &runtime.dsl.round_trip_time);
+                    update_smoothed_round_trip_time(&runtime.dsl.smoothed_round_trip_time, &runtime.dsl.round_trip_time_variation, runtime.dsl.round_trip_time);
                     runtime.dsl.last_hello_received = timestamp.seconds;
                     runtime.dsl.missed_hellos = 0;
                     logger(LOG_DEBUG, "Round trip time for DSL: %u.%03us\n", runtime.dsl.round_trip_time.tv_sec, runtime.dsl.round_trip_time.tv_usec / 1000);
                 }
+                update_reorder_buffer_timeout();
+                update_flowlet_timeout();
 
             case GRECP_MSGATTR_PADDING:
                 break;
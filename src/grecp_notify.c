@@ -135,6 +135,14 @@ void handle_grecpnotify(uint8_t tuntype, void *buffer, int size) {
             case GRECP_MSGATTR_TUNNEL_VERIFICATION:
                 runtime.lte.tunnel_verification_required = true;
                 break;
+            case GRECP_MSGATTR_CONFIGURED_DSL_UPSTREAM_BANDWIDTH:
+                if (attr.length != sizeof(runtime.haap.dsl_upstream_bandwidth)) {
+                    logger(LOG_DEBUG, "Invalid length of configured dsl upstream bandwidth in notify message received: %u\n", attr.length);
+                    break;
+                }
+                memcpy(&runtime.haap.dsl_upstream_bandwidth, attr.value, sizeof(runtime.haap.dsl_upstream_bandwidth));
+                runtime.haap.dsl_upstream_bandwidth = ntohl(runtime.haap.dsl_upstream_bandwidth);
+                break;
             case GRECP_MSGATTR_BYPASS_TRAFFIC_RATE:
             case GRECP_MSGATTR_PADDING:
                 break;
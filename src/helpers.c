@@ -33,6 +33,26 @@ inline struct timeval get_uptime() {
     return ret;
 }
 
+/* RFC 6298 style smoothing, srtt and rttvar start out cleared */
+void update_smoothed_round_trip_time(struct timeval *srtt, struct timeval *rttvar, struct timeval rtt) {
+    int64_t r = (int64_t)rtt.tv_sec * 1000000 + rtt.tv_usec;
+    int64_t s = (int64_t)srtt->tv_sec * 1000000 + srtt->tv_usec;
+    int64_t v = (int64_t)rttvar->tv_sec * 1000000 + rttvar->tv_usec;
+
+    if (!timerisset(srtt)) {
+        s = r;
+        v = r / 2;
+    } else {
+        v = (3 * v + llabs(s - r)) / 4;
+        s = (7 * s + r) / 8;
+    }
+
+    srtt->tv_sec = s / 1000000;
+    srtt->tv_usec = s % 1000000;
+    rttvar->tv_sec = v / 1000000;
+    rttvar->tv_usec = v % 1000000;
+}
+
 struct in6_addr get_primary_ip6(char *interface) {
     struct in6_addr ip = {};
 
@@ -16,4 +16,5 @@
  */
 bool isvalueinarray(uint8_t val, uint8_t *arr, uint8_t size);
 struct timeval get_uptime();
-struct in6_addr get_primary_ip6(char *interface);
\ No newline at end of file
+struct in6_addr get_primary_ip6(char *interface);
+void update_smoothed_round_trip_time(struct timeval *srtt, struct timeval *rttvar, struct timeval rtt);
\ No newline at end of file
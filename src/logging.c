@@ -106,4 +106,54 @@ void logger_bitdump(int8_t log_level, uint8_t byte, const char* format, ...) {
     if (log_level == LOG_FATAL) {
         exit(EXIT_FAILURE);
     }    
+}
+
+void log_statistics() {
+    /* send rates are averaged since the previous statistics, or since we started */
+    static struct timeval last;
+    static uint64_t last_lte_bytes, last_dsl_bytes;
+    struct timeval now = get_uptime();
+    if (!timerisset(&last))
+        last = runtime.stats.started;
+    struct timeval elapsed;
+    timersub(&now, &last, &elapsed);
+    uint64_t elapsed_ms = elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000;
+    uint64_t lte_bytes = runtime.stats.lte_sent_bytes;
+    uint64_t dsl_bytes = runtime.stats.dsl_sent_bytes;
+    uint64_t lte_rate = elapsed_ms ? (lte_bytes - last_lte_bytes) * 8 / elapsed_ms : 0;
+    uint64_t dsl_rate = elapsed_ms ? (dsl_bytes - last_dsl_bytes) * 8 / elapsed_ms : 0;
+    last = now;
+    last_lte_bytes = lte_bytes;
+    last_dsl_bytes = dsl_bytes;
+
+    logger(LOG_INFO, "Statistics:\n"
+                     "  Reorder buffer pool exhausted: %" PRIu64 "\n"
+                     "  Reorder buffer late or duplicate packets: %" PRIu64 "\n"
+                     "  Reorder buffer lost packets: %" PRIu64 "\n"
+                     "  Reorder buffer resynchronizations: %" PRIu64 "\n"
+                     "  Reorder buffer byte budget exceeded: %" PRIu64 "\n"
+                     "  Reorder buffer ecn marked packets: %" PRIu64 "\n"
+                     "  Reorder buffer codel dropped packets: %" PRIu64 "\n"
+                     "  Reorder buffer bypassed packets: %" PRIu64 "\n"
+                     "  Tun device queue full dropped packets: %" PRIu64 "\n"
+                     "  LTE sent packets: %" PRIu64 ", bytes: %" PRIu64 ", rate: %" PRIu64 " kbit/s\n"
+                     "  DSL sent packets: %" PRIu64 ", bytes: %" PRIu64 ", rate: %" PRIu64 " kbit/s, upstream rate: %u kbit/s\n"
+                     "  DSL overflowed to LTE packets: %" PRIu64 "\n"
+                     "  Upstream priority packets: %" PRIu64 "\n"
+                     "  Send queue dropped packets, LTE: %" PRIu64 ", DSL: %" PRIu64 ", overflowed to the other tunnel: %" PRIu64 "\n",
+                     runtime.stats.reorder_pool_exhausted,
+                     runtime.stats.reorder_late,
+                     runtime.stats.reorder_gaps,
+                     runtime.stats.reorder_resyncs,
+                     runtime.stats.reorder_overlimit,
+                     runtime.stats.reorder_ecn_marked,
+                     runtime.stats.reorder_codel_dropped,
+                     runtime.stats.reorder_bypassed,
+                     runtime.stats.tun_output_dropped,
+                     (uint64_t)runtime.stats.lte_sent_packets, lte_bytes, lte_rate,
+                     (uint64_t)runtime.stats.dsl_sent_packets, dsl_bytes, dsl_rate, scheduler_dsl_rate(),
+                     (uint64_t)runtime.stats.dsl_overflowed,
+                     (uint64_t)runtime.stats.upstream_priority_packets,
+                     (uint64_t)runtime.stats.lte_send_queue_dropped, (uint64_t)runtime.stats.dsl_send_queue_dropped,
+                     (uint64_t)runtime.stats.send_queue_overflowed);
 }
\ No newline at end of file
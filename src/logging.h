@@ -26,4 +26,5 @@ enum {
 
 void logger(uint8_t log_level, const char* format, ...);
 void logger_hexdump(int8_t log_level, void *buffer, int size, const char* format, ...);
-void logger_bitdump(int8_t log_level, uint8_t byte, const char* format, ...);
\ No newline at end of file
+void logger_bitdump(int8_t log_level, uint8_t byte, const char* format, ...);
+void log_statistics();
\ No newline at end of file
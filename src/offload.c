@@ -0,0 +1,300 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "openhybrid.h"
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+#define TCP_FLAG_CWR 0x80
+
+/* ones' complement sum of data in network byte order, fold before use */
+static uint64_t checksum_add(uint64_t sum, const unsigned char *data, uint32_t size) {
+    uint32_t word;
+    uint16_t half = 0;
+    while (size >= 4) {
+        memcpy(&word, data, 4);
+        sum += word;
+        data += 4;
+        size -= 4;
+    }
+    if (size >= 2) {
+        memcpy(&half, data, 2);
+        sum += half;
+        data += 2;
+        size -= 2;
+    }
+    if (size) {
+        half = 0;
+        memcpy(&half, data, 1);
+        sum += half;
+    }
+    return sum;
+}
+
+static uint16_t checksum_fold(uint64_t sum) {
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static uint64_t checksum_pseudo_header(const unsigned char *packet, uint8_t protocol, uint32_t l4_size) {
+    uint64_t sum;
+    if ((packet[0] >> 4) == 4)
+        sum = checksum_add(0, packet + 12, 8);
+    else
+        sum = checksum_add(0, packet + 8, 32);
+    return sum + htons(protocol) + htons(l4_size);
+}
+
+static void checksum_ipv4_header(unsigned char *packet) {
+    uint16_t checksum = 0;
+    memcpy(packet + 10, &checksum, 2);
+    checksum = ~checksum_fold(checksum_add(0, packet, (packet[0] & 0x0f) * 4));
+    memcpy(packet + 10, &checksum, 2);
+}
+
+/* full transport checksum, the checksum field has to be zero */
+static void checksum_l4(unsigned char *packet, uint32_t size, uint8_t protocol, uint16_t l4_offset, uint16_t checksum_offset) {
+    uint16_t checksum = ~checksum_fold(checksum_add(checksum_pseudo_header(packet, protocol, size - l4_offset), packet + l4_offset, size - l4_offset));
+    if (checksum == 0)
+        checksum = 0xffff;
+    memcpy(packet + l4_offset + checksum_offset, &checksum, 2);
+}
+
+/* packet handed over with only the pseudo header summed up, finish its checksum */
+bool checksum_complete(struct virtio_net_hdr *vnet, unsigned char *packet, uint32_t size) {
+    if (!(vnet->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+        return true;
+    if ((uint32_t)vnet->csum_start + vnet->csum_offset + 2 > size)
+        return false;
+    uint16_t checksum = ~checksum_fold(checksum_add(0, packet + vnet->csum_start, size - vnet->csum_start));
+    if (checksum == 0)
+        checksum = 0xffff;
+    memcpy(packet + vnet->csum_start + vnet->csum_offset, &checksum, 2);
+    return true;
+}
+
+/* returns false if the packet isn't a gso packet we know how to split */
+bool gso_init(struct gso_segmenter *gso, struct virtio_net_hdr *vnet, unsigned char *packet, uint32_t size) {
+    uint8_t type = vnet->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    gso->packet = packet;
+    gso->size = size;
+    gso->segment_size = vnet->gso_size;
+    gso->index = 0;
+
+    if ((size >= 20) && ((packet[0] >> 4) == 4) && ((type == VIRTIO_NET_HDR_GSO_TCPV4) || (type == VIRTIO_NET_HDR_GSO_UDP_L4))) {
+        gso->l4_offset = (packet[0] & 0x0f) * 4;
+        gso->protocol = packet[9];
+    } else if ((size >= 40) && ((packet[0] >> 4) == 6) && ((type == VIRTIO_NET_HDR_GSO_TCPV6) || (type == VIRTIO_NET_HDR_GSO_UDP_L4))) {
+        /* might be behind extension headers */
+        gso->l4_offset = (vnet->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) ? vnet->csum_start : 40;
+        gso->protocol = (type == VIRTIO_NET_HDR_GSO_UDP_L4) ? IPPROTO_UDP : IPPROTO_TCP;
+    } else {
+        return false;
+    }
+
+    if ((gso->protocol != ((type == VIRTIO_NET_HDR_GSO_UDP_L4) ? IPPROTO_UDP : IPPROTO_TCP)) || (gso->l4_offset + 20 > size))
+        return false;
+    if (gso->protocol == IPPROTO_TCP)
+        gso->header_size = gso->l4_offset + (packet[gso->l4_offset + 12] >> 4) * 4;
+    else
+        gso->header_size = gso->l4_offset + 8;
+    if ((gso->header_size > size) || (gso->segment_size == 0) || (gso->header_size + gso->segment_size > MAX_PKT_SIZE))
+        return false;
+    return true;
+}
+
+/* writes the next segment, returns its size or 0 if there are no more */
+uint16_t gso_next(struct gso_segmenter *gso, unsigned char *segment) {
+    uint32_t offset = gso->header_size + (uint32_t)gso->index * gso->segment_size;
+    if (offset >= gso->size)
+        return 0;
+    uint16_t payload_size = (gso->size - offset < gso->segment_size) ? gso->size - offset : gso->segment_size;
+    uint16_t size = gso->header_size + payload_size;
+    bool last = (offset + payload_size >= gso->size);
+    uint16_t value16;
+    uint32_t value32;
+
+    memcpy(segment, gso->packet, gso->header_size);
+    memcpy(segment + gso->header_size, gso->packet + offset, payload_size);
+
+    if ((segment[0] >> 4) == 4) {
+        value16 = htons(size);
+        memcpy(segment + 2, &value16, 2);
+        memcpy(&value16, gso->packet + 4, 2);
+        value16 = htons(ntohs(value16) + gso->index);
+        memcpy(segment + 4, &value16, 2);
+        checksum_ipv4_header(segment);
+    } else {
+        value16 = htons(size - 40);
+        memcpy(segment + 4, &value16, 2);
+    }
+
+    value16 = 0;
+    if (gso->protocol == IPPROTO_TCP) {
+        memcpy(&value32, gso->packet + gso->l4_offset + 4, 4);
+        value32 = htonl(ntohl(value32) + (uint32_t)gso->index * gso->segment_size);
+        memcpy(segment + gso->l4_offset + 4, &value32, 4);
+        if (!last)
+            segment[gso->l4_offset + 13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        if (gso->index > 0)
+            segment[gso->l4_offset + 13] &= ~TCP_FLAG_CWR;
+        memcpy(segment + gso->l4_offset + 16, &value16, 2);
+        checksum_l4(segment, size, IPPROTO_TCP, gso->l4_offset, 16);
+    } else {
+        memcpy(segment + gso->l4_offset + 6, &value16, 2);
+        value16 = htons(size - gso->l4_offset);
+        memcpy(segment + gso->l4_offset + 4, &value16, 2);
+        checksum_l4(segment, size, IPPROTO_UDP, gso->l4_offset, 6);
+    }
+
+    gso->index++;
+    return size;
+}
+
+/* offset of the tcp header if the packet can take part in coalescing, 0 otherwise */
+static uint16_t gro_l4_offset(unsigned char *packet, uint16_t size) {
+    uint16_t l4_offset;
+    uint16_t header_size;
+    uint16_t value16;
+    if ((size >= 40) && (packet[0] == 0x45) && (packet[9] == IPPROTO_TCP)) {
+        /* no options, not fragmented */
+        memcpy(&value16, packet + 6, 2);
+        if (ntohs(value16) & 0x3fff)
+            return 0;
+        memcpy(&value16, packet + 2, 2);
+        if (ntohs(value16) != size)
+            return 0;
+        l4_offset = 20;
+    } else if ((size >= 60) && ((packet[0] >> 4) == 6) && (packet[6] == IPPROTO_TCP)) {
+        memcpy(&value16, packet + 4, 2);
+        if (ntohs(value16) + 40 != size)
+            return 0;
+        l4_offset = 40;
+    } else {
+        return 0;
+    }
+
+    /* plain data segments only, anything else has to reach the stack on its own */
+    header_size = l4_offset + (packet[l4_offset + 12] >> 4) * 4;
+    if ((header_size < l4_offset + 20) || (header_size >= size))
+        return 0;
+    if ((packet[l4_offset + 13] & ~TCP_FLAG_PSH) != TCP_FLAG_ACK)
+        return 0;
+
+    /* we take responsibility for the checksum of the coalesced packet, so the segments have to be intact */
+    if (checksum_fold(checksum_add(checksum_pseudo_header(packet, IPPROTO_TCP, size - l4_offset), packet + l4_offset, size - l4_offset)) != 0xffff)
+        return 0;
+    return l4_offset;
+}
+
+/* returns false if the packet can't be coalesced with anything */
+bool gro_start(struct gro *gro, unsigned char *packet, uint16_t size) {
+    uint32_t sequence;
+    gro->l4_offset = gro_l4_offset(packet, size);
+    if (!gro->l4_offset)
+        return false;
+    gro->header_size = gro->l4_offset + (packet[gro->l4_offset + 12] >> 4) * 4;
+    gro->segment_size = size - gro->header_size;
+    gro->size = size;
+    memcpy(&sequence, packet + gro->l4_offset + 4, 4);
+    gro->sequence_next = ntohl(sequence) + gro->segment_size;
+    gro->push = (packet[gro->l4_offset + 13] & TCP_FLAG_PSH);
+    gro->closed = gro->push;
+    gro->iovecs[1].iov_base = packet;
+    gro->iovecs[1].iov_len = size;
+    gro->packets[0] = packet;
+    gro->count = 1;
+    return true;
+}
+
+/* returns false if the packet doesn't continue the flow, the coalesced packet has to be finished first */
+bool gro_append(struct gro *gro, unsigned char *packet, uint16_t size) {
+    unsigned char *first = gro->packets[0];
+    uint32_t sequence;
+    if ((gro->closed) || (gro->count >= GRO_MAX_SEGMENTS))
+        return false;
+    if ((gro_l4_offset(packet, size) != gro->l4_offset) || (packet[gro->l4_offset + 12] != first[gro->l4_offset + 12]))
+        return false;
+    if (size - gro->header_size > gro->segment_size)
+        return false;
+    if (gro->size + size - gro->header_size > MAX_GSO_PKT_SIZE)
+        return false;
+
+    /* same flow and ip header fields the stack would keep for all segments */
+    if (gro->l4_offset == 20) {
+        if ((packet[1] != first[1]) || ((packet[6] & 0x40) != (first[6] & 0x40)) || (packet[8] != first[8]) || (memcmp(packet + 12, first + 12, 8) != 0))
+            return false;
+    } else {
+        if ((memcmp(packet, first, 4) != 0) || (packet[7] != first[7]) || (memcmp(packet + 8, first + 8, 32) != 0))
+            return false;
+    }
+
+    /* ports, ack, window and options have to match, sequence has to follow */
+    if ((memcmp(packet + gro->l4_offset, first + gro->l4_offset, 4) != 0) ||
+        (memcmp(packet + gro->l4_offset + 8, first + gro->l4_offset + 8, 4) != 0) ||
+        (memcmp(packet + gro->l4_offset + 14, first + gro->l4_offset + 14, 2) != 0) ||
+        (memcmp(packet + gro->l4_offset + 20, first + gro->l4_offset + 20, gro->header_size - gro->l4_offset - 20) != 0))
+        return false;
+    memcpy(&sequence, packet + gro->l4_offset + 4, 4);
+    if (ntohl(sequence) != gro->sequence_next)
+        return false;
+
+    gro->iovecs[gro->count + 1].iov_base = packet + gro->header_size;
+    gro->iovecs[gro->count + 1].iov_len = size - gro->header_size;
+    gro->packets[gro->count++] = packet;
+    gro->size += size - gro->header_size;
+    gro->sequence_next += size - gro->header_size;
+    if (packet[gro->l4_offset + 13] & TCP_FLAG_PSH)
+        gro->push = true;
+    gro->closed = (gro->push) || (size - gro->header_size < gro->segment_size);
+    return true;
+}
+
+/* turn the first packet into the header of the coalesced one, returns the number of iovecs to write */
+int gro_finish(struct gro *gro) {
+    unsigned char *first = gro->packets[0];
+    uint16_t value16;
+    memset(&gro->vnet, 0, sizeof(gro->vnet));
+    gro->iovecs[0].iov_base = &gro->vnet;
+    gro->iovecs[0].iov_len = sizeof(gro->vnet);
+    if (gro->count == 1)
+        return 2;
+
+    if (gro->l4_offset == 20) {
+        value16 = htons(gro->size);
+        memcpy(first + 2, &value16, 2);
+        checksum_ipv4_header(first);
+        gro->vnet.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    } else {
+        value16 = htons(gro->size - 40);
+        memcpy(first + 4, &value16, 2);
+        gro->vnet.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+    }
+    if (gro->push)
+        first[gro->l4_offset + 13] |= TCP_FLAG_PSH;
+
+    /* the stack fills in the checksum of every segment, starting from the pseudo header */
+    value16 = checksum_fold(checksum_pseudo_header(first, IPPROTO_TCP, gro->size - gro->l4_offset));
+    memcpy(first + gro->l4_offset + 16, &value16, 2);
+    gro->vnet.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    gro->vnet.hdr_len = gro->header_size;
+    gro->vnet.gso_size = gro->segment_size;
+    gro->vnet.csum_start = gro->l4_offset;
+    gro->vnet.csum_offset = 16;
+    return gro->count + 1;
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <linux/virtio_net.h>
+#include <sys/uio.h>
+
+/* newer than some of the kernel headers we're built against */
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#define VIRTIO_NET_HDR_GSO_UDP_L4 5
+#endif
+
+/* largest packet the tun device hands us with offloads enabled */
+#define MAX_GSO_PKT_SIZE 65535
+
+/* splits a gso packet read from the tun device into mtu sized packets */
+struct gso_segmenter {
+    unsigned char *packet;
+    uint32_t size;
+    uint8_t protocol;
+    uint16_t l4_offset;
+    uint16_t header_size;
+    uint16_t segment_size;
+    uint16_t index;
+};
+
+/* coalesces consecutive in-order tcp segments of a flow into a single gso packet */
+#define GRO_MAX_SEGMENTS 64
+
+struct gro {
+    struct virtio_net_hdr vnet;
+    /* vnet header (iovec 0), first packet including headers, payloads of the following ones */
+    struct iovec iovecs[GRO_MAX_SEGMENTS + 1];
+    void *packets[GRO_MAX_SEGMENTS];
+    uint16_t count;
+    uint32_t size;
+    uint16_t l4_offset;
+    uint16_t header_size;
+    uint16_t segment_size;
+    uint32_t sequence_next;
+    bool push;
+    bool closed; /* last segment was short or pushed, nothing can follow it */
+};
+
+bool checksum_complete(struct virtio_net_hdr *vnet, unsigned char *packet, uint32_t size);
+bool gso_init(struct gso_segmenter *gso, struct virtio_net_hdr *vnet, unsigned char *packet, uint32_t size);
+uint16_t gso_next(struct gso_segmenter *gso, unsigned char *segment);
+bool gro_start(struct gro *gro, unsigned char *packet, uint16_t size);
+bool gro_append(struct gro *gro, unsigned char *packet, uint16_t size);
+int gro_finish(struct gro *gro);
\ No newline at end of file
@@ -17,7 +17,7 @@
 #include "openhybrid.h"
 #include <sys/wait.h>
 #include <signal.h>
-#include <linux/filter.h>
+#include <sys/eventfd.h>
 
 void open_grecp_socket() {
     sockfd = socket(AF_INET6, SOCK_RAW, IPPROTO_GRE);
@@ -31,20 +31,7 @@ void open_grecp_socket() {
         logger(LOG_FATAL, "Configuration of raw socket failed: %s\n", strerror(errno));
     }
 
-    /* BPF filter to exclude non control-plane messages */
-    struct sock_filter bpfcode[] = {
-        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2), /* load gre->proto */
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, GRECP_PROTO, 0, 1), /* skip next line if it's != GRECP_PROTO  */
-        BPF_STMT(BPF_RET | BPF_K, -1), /* accept packet */
-        BPF_STMT(BPF_RET | BPF_K, 0), /* discard packet */
-    };
-    struct sock_fprog bpfprog = {
-        .len = 4,
-        .filter = bpfcode,
-    };
-    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &bpfprog, sizeof(bpfprog)) < 0) {
-        logger(LOG_ERROR, "Attaching BPF failed: %s\n", strerror(errno));
-    }
+    attach_grecp_socket_filter();
 }
 
 int close_grecp_socket() {
@@ -101,6 +88,9 @@ void execute_timers() {
         runtime.dsl.tunnel_established = false;
     }
 
+    /* tell the receiver, it has to stop waiting for packets sent via a dead tunnel */
+    update_tunnel_state();
+
     /* bypass bandwidth */
     if ((runtime.dsl.tunnel_established) && (runtime.dsl.last_bypass_traffic_sent < get_uptime().tv_sec - runtime.haap.bypass_bandwidth_check_interval)) {
         send_grecpnotify_bypasstraffic(1000); /* FIXME: calculate on demand */
@@ -113,6 +103,8 @@ void execute_timers() {
         runtime.lte.last_hello_sent = 0;
         runtime.lte.last_hello_received = 0;
         runtime.lte.tunnel_verification_required = false;
+        timerclear(&runtime.lte.smoothed_round_trip_time);
+        timerclear(&runtime.lte.round_trip_time_variation);
     }
     if ((!runtime.dsl.tunnel_established) && (runtime.tunnel_interface_created)) {
         runtime.dsl.tunnel_established = false;
@@ -120,11 +112,18 @@ void execute_timers() {
         runtime.dsl.last_hello_sent = 0;
         runtime.dsl.last_hello_received = 0;
         runtime.dsl.last_bypass_traffic_sent = 0;
+        timerclear(&runtime.dsl.smoothed_round_trip_time);
+        timerclear(&runtime.dsl.round_trip_time_variation);
     }
+    /* timeouts derived from the round trip times fall back until both are known again */
+    update_reorder_buffer_timeout();
+    update_flowlet_timeout();
     if ((!runtime.lte.tunnel_established) && (!runtime.dsl.tunnel_established)) {
         runtime.haap.ip = runtime.haap.anycast_ip;
         runtime.haap.bonding_key = 0;
         runtime.haap.session_id = 0;
+        runtime.haap.dsl_upstream_bandwidth = 0;
+        update_socket_filters();
 
         runtime.haap.filter_list.commit_count = 0;
         runtime.filter_list_acked = false;
@@ -270,6 +269,10 @@ void execute_timers() {
                 trigger_event("shutdown");
                 exit(EXIT_SUCCESS);
                 break;
+            case SIGUSR1:
+                log_statistics();
+                runtime.signal = 0;
+                break;
             default:
                 logger(LOG_WARNING, "Unhandled signal received: %i\n", runtime.signal);
                 runtime.signal = 0;
@@ -293,12 +296,18 @@ int main(int argc, char **argv, char **envp) {
         return(EXIT_FAILURE);
     }
     read_config(argv[1]);
+    runtime.stats.started = get_uptime();
 
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
+    signal(SIGUSR1, handle_signal);
 
     create_dhcp_script();
     open_grecp_socket();
+    eventfd_tunnel_state = eventfd(0, EFD_NONBLOCK);
+    if (eventfd_tunnel_state < 0) {
+        logger(LOG_FATAL, "Creation of eventfd failed: %s\n", strerror(errno));
+    }
     logger(LOG_INFO, "OpenHybrid started.\n");
     trigger_event("startup");
 
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <errno.h>
 #include <netinet/ip6.h>
@@ -33,6 +34,7 @@
 #include <time.h>
 #include <net/if.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 /* Custom includes */
 #include "grecp.h"
@@ -50,10 +52,42 @@
 #include "event.h"
 #include "tun2gre.h"
 #include "gre2tun.h"
+#include "pool.h"
+#include "ring.h"
+#include "offload.h"
+#include "xdp.h"
+#include "tpacket.h"
+#include "uring.h"
+#include "scheduler.h"
 
 /* GRECP already supports fragmentation of large message, we shouldn't need IP fragmentation */
 #define MAX_PKT_SIZE 1500
 
+/* Sequence numbers start here in soak test mode, they wrap around after 65536 packets */
+#define SEQUENCE_SOAK_TEST_START (UINT32_MAX - 65535)
+
+/* Maximum number of tun device queues, each one gets its own reader and writer thread */
+#define MAX_TUNNEL_QUEUES 8
+
+/* Where the receiver gets gre packets from, the raw socket is always used for whatever the others don't take */
+enum {
+    RECEIVE_BACKEND_SOCKET = 0,
+    RECEIVE_BACKEND_XDP = 1,
+    RECEIVE_BACKEND_TPACKET = 2
+};
+
+/* How upstream packets are spread across the tunnels */
+enum {
+    UPSTREAM_SCHEDULER_OVERFLOW = 0,
+    UPSTREAM_SCHEDULER_EARLIEST_ARRIVAL = 1
+};
+
+/* What happens to packets for a tunnel whose send queue is full */
+enum {
+    SEND_QUEUE_POLICY_DROP = 0,
+    SEND_QUEUE_POLICY_OVERFLOW = 1
+};
+
 /* Global structs to hold and statuses and configs */
 struct {
     /* shared with haap */
@@ -69,6 +103,7 @@ struct {
             /* TODO: hold actual filer list */
         } filter_list;
         uint32_t bypass_bandwidth_check_interval;
+        uint32_t dsl_upstream_bandwidth; /* kbit/s */
     } haap;
     /* local stuff */
     bool bonding;
@@ -77,11 +112,45 @@ struct {
     uint16_t tunnel_interface_mtu;
     bool tunnel_interface_created;
     char tunnel_interface_name[IF_NAMESIZE];
+    uint8_t tunnel_queues;
+    bool tunnel_offload;
     pthread_t gre2tun_thread;
     pthread_t tun2gre_thread;
     volatile int signal;
     char event_script_path[128];
-    struct timeval reorder_buffer_timeout;
+    _Atomic uint64_t reorder_buffer_timeout; /* us, read by the receiver while hellos adjust it */
+    bool reorder_buffer_timeout_adaptive;
+    struct timeval reorder_buffer_timeout_min;
+    struct timeval reorder_buffer_timeout_max;
+    uint32_t reorder_buffer_size;
+    uint32_t reorder_buffer_bytes;
+    struct timeval reorder_buffer_codel_target;
+    struct timeval reorder_buffer_codel_interval;
+    struct {
+        bool enabled;
+        bool udp;
+        bool icmp;
+        uint8_t ports[65536 / 8]; /* bitmap, tcp and udp source or destination port */
+        uint64_t dscp; /* bitmap */
+    } reorder_buffer_bypass;
+    uint16_t receive_batch_size;
+    uint8_t receive_backend;
+    bool xdp_native;
+    bool io_uring;
+    uint16_t send_batch_size;
+    uint32_t send_queue_size; /* 0 = no sender threads */
+    uint8_t send_queue_policy;
+    uint32_t dsl_upstream_rate; /* kbit/s */
+    uint32_t dsl_upstream_burst; /* ms */
+    uint32_t lte_upstream_rate; /* kbit/s */
+    uint8_t upstream_scheduler;
+    struct {
+        uint8_t ports[65536 / 8]; /* bitmap, tcp and udp source or destination port */
+        uint64_t dscp; /* bitmap */
+    } upstream_priority;
+    _Atomic uint64_t flowlet_timeout; /* us, read by the readers while hellos adjust it */
+    bool flowlet_timeout_adaptive;
+    bool sequence_soak_test;
     struct {
         pid_t udhcpc_pid;
         struct in_addr ip;
@@ -104,6 +173,8 @@ struct {
         bool tunnel_verification_required;
         struct in6_addr interface_ip;
         struct timeval round_trip_time;
+        struct timeval smoothed_round_trip_time;
+        struct timeval round_trip_time_variation;
     } lte;
     struct {
         char interface_name[IF_NAMESIZE];
@@ -114,10 +185,38 @@ struct {
         time_t last_bypass_traffic_sent;
         struct in6_addr interface_ip;
         struct timeval round_trip_time;
+        struct timeval smoothed_round_trip_time;
+        struct timeval round_trip_time_variation;
     } dsl;
+    struct {
+        struct timeval started;
+        uint64_t reorder_pool_exhausted;
+        uint64_t reorder_late;
+        uint64_t reorder_gaps;
+        uint64_t reorder_resyncs;
+        uint64_t reorder_overlimit;
+        uint64_t reorder_ecn_marked;
+        uint64_t reorder_codel_dropped;
+        uint64_t reorder_bypassed;
+        uint64_t tun_output_dropped;
+        /* updated by the sender threads of all tun device queues */
+        _Atomic uint64_t lte_sent_packets;
+        _Atomic uint64_t lte_sent_bytes;
+        _Atomic uint64_t dsl_sent_packets;
+        _Atomic uint64_t dsl_sent_bytes;
+        _Atomic uint64_t dsl_overflowed;
+        _Atomic uint64_t upstream_priority_packets;
+        _Atomic uint64_t lte_send_queue_dropped;
+        _Atomic uint64_t dsl_send_queue_dropped;
+        _Atomic uint64_t send_queue_overflowed;
+    } stats;
 } runtime;
 
 /* Raw socket */
 int sockfd;
 int sockfd_gre;
-int sockfd_tun;
\ No newline at end of file
+int sockfd_tun;
+int sockfd_tun_queues[MAX_TUNNEL_QUEUES];
+
+/* Signals tunnel state changes to the receiver */
+int eventfd_tunnel_state;
\ No newline at end of file
@@ -0,0 +1,56 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "openhybrid.h"
+
+/* allocate all slots at once, so the data path never has to call malloc */
+bool pool_create(struct packet_pool *pool, uint32_t slots, uint32_t slot_size) {
+    pool->slot_size = slot_size;
+    pool->slots = slots;
+    /* page aligned, so the pool can be registered as af_xdp umem */
+    if ((errno = posix_memalign((void **)&pool->slab, sysconf(_SC_PAGESIZE), (size_t)slots * slot_size)) != 0)
+        pool->slab = NULL;
+    pool->free = malloc(slots * sizeof(void *));
+    if ((!pool->slab) || (!pool->free)) {
+        logger(LOG_ERROR, "Allocation of packet pool failed: %s\n", strerror(errno));
+        pool_destroy(pool);
+        return false;
+    }
+    for (pool->free_count = 0; pool->free_count < slots; pool->free_count++)
+        pool->free[pool->free_count] = pool->slab + (size_t)(slots - pool->free_count - 1) * slot_size;
+    return true;
+}
+
+void pool_destroy(struct packet_pool *pool) {
+    free(pool->slab);
+    free(pool->free);
+    pool->slab = NULL;
+    pool->free = NULL;
+    pool->free_count = 0;
+}
+
+/* returns NULL if the pool is exhausted */
+void *pool_get(struct packet_pool *pool) {
+    if (pool->free_count == 0)
+        return NULL;
+    return pool->free[--pool->free_count];
+}
+
+/* packet may point anywhere inside of the slot */
+void pool_put(struct packet_pool *pool, void *packet) {
+    size_t slot = ((unsigned char *)packet - pool->slab) / pool->slot_size;
+    pool->free[pool->free_count++] = pool->slab + slot * pool->slot_size;
+}
\ No newline at end of file
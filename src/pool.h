@@ -0,0 +1,29 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+struct packet_pool {
+    unsigned char *slab;
+    uint32_t slot_size;
+    uint32_t slots;
+    /* stack of free slots */
+    void **free;
+    uint32_t free_count;
+};
+
+bool pool_create(struct packet_pool *pool, uint32_t slots, uint32_t slot_size);
+void pool_destroy(struct packet_pool *pool);
+void *pool_get(struct packet_pool *pool);
+void pool_put(struct packet_pool *pool, void *packet);
\ No newline at end of file
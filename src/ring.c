@@ -0,0 +1,64 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "openhybrid.h"
+
+/* capacity is rounded up to the next power of two */
+bool ring_create(struct ring *ring, uint32_t capacity) {
+    ring->capacity = 1;
+    while (ring->capacity < capacity)
+        ring->capacity <<= 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->entries = calloc(ring->capacity, sizeof(struct ring_entry));
+    if (!ring->entries) {
+        logger(LOG_ERROR, "Allocation of ring failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void ring_destroy(struct ring *ring) {
+    free(ring->entries);
+    ring->entries = NULL;
+}
+
+/* producer side, returns false if the ring is full */
+bool ring_push(struct ring *ring, void *packet, uint16_t size) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= ring->capacity)
+        return false;
+    ring->entries[tail & (ring->capacity - 1)].packet = packet;
+    ring->entries[tail & (ring->capacity - 1)].size = size;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/* consumer side, returns false if the ring is empty */
+bool ring_pop(struct ring *ring, void **packet, uint16_t *size) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+        return false;
+    *packet = ring->entries[head & (ring->capacity - 1)].packet;
+    *size = ring->entries[head & (ring->capacity - 1)].size;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+/* number of packets in the ring, on the producer side it never underestimates */
+uint32_t ring_count(struct ring *ring) {
+    return atomic_load_explicit(&ring->tail, memory_order_relaxed) - atomic_load_explicit(&ring->head, memory_order_acquire);
+}
\ No newline at end of file
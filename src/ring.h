@@ -0,0 +1,37 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdatomic.h>
+
+struct ring_entry {
+    void *packet;
+    uint16_t size;
+};
+
+/* lock-free single producer single consumer queue of packets */
+struct ring {
+    struct ring_entry *entries;
+    uint32_t capacity; /* power of two */
+    /* consumer and producer index on separate cache lines, they are written by different threads */
+    _Alignas(64) _Atomic uint32_t head;
+    _Alignas(64) _Atomic uint32_t tail;
+};
+
+bool ring_create(struct ring *ring, uint32_t capacity);
+void ring_destroy(struct ring *ring);
+bool ring_push(struct ring *ring, void *packet, uint16_t size);
+bool ring_pop(struct ring *ring, void **packet, uint16_t *size);
+uint32_t ring_count(struct ring *ring);
\ No newline at end of file
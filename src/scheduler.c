@@ -0,0 +1,304 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "openhybrid.h"
+#include <netinet/in.h>
+
+static struct token_bucket dsl_bucket;
+static struct token_bucket lte_bucket;
+
+static uint64_t scheduler_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* kbit/s the dsl tunnel is filled up to before overflowing to lte, 0 if unknown */
+uint32_t scheduler_dsl_rate() {
+    return runtime.dsl_upstream_rate ? runtime.dsl_upstream_rate : runtime.haap.dsl_upstream_bandwidth;
+}
+
+/* takes tokens for size bytes, fails without taking any if the bucket doesn't hold enough
+ * forced takes always succeed and leave the bucket in debt, for packets sent regardless */
+static bool token_bucket_take(struct token_bucket *tb, uint64_t now, uint32_t rate, uint32_t size, bool force) {
+    /* at 1 kbit/s a byte takes 8 ms */
+    uint64_t cost = (uint64_t)size * 8000000 / rate;
+    uint64_t burst = (uint64_t)runtime.dsl_upstream_burst * 1000000;
+    if (burst < cost * 2)
+        burst = cost * 2;
+
+    uint64_t full_at = atomic_load_explicit(&tb->full_at, memory_order_relaxed);
+    uint64_t next;
+    do {
+        next = ((full_at > now) ? full_at : now) + cost;
+        if ((next > now + burst) && (!force))
+            return false;
+    } while (!atomic_compare_exchange_weak_explicit(&tb->full_at, &full_at, next, memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+/* adaptive timeout: difference of the smoothed round trip times plus their variation, the default until both are known */
+void update_flowlet_timeout() {
+    if (!runtime.flowlet_timeout_adaptive)
+        return;
+
+    struct timeval timeout = { .tv_usec = FLOWLET_TIMEOUT_DEFAULT };
+    if ((timerisset(&runtime.lte.smoothed_round_trip_time)) && (timerisset(&runtime.dsl.smoothed_round_trip_time))) {
+        if (timercmp(&runtime.lte.smoothed_round_trip_time, &runtime.dsl.smoothed_round_trip_time, >))
+            timersub(&runtime.lte.smoothed_round_trip_time, &runtime.dsl.smoothed_round_trip_time, &timeout);
+        else
+            timersub(&runtime.dsl.smoothed_round_trip_time, &runtime.lte.smoothed_round_trip_time, &timeout);
+        timeradd(&timeout, &runtime.lte.round_trip_time_variation, &timeout);
+        timeradd(&timeout, &runtime.dsl.round_trip_time_variation, &timeout);
+    }
+
+    /* published as a single word, the readers use it without locking */
+    uint64_t usec = (uint64_t)timeout.tv_sec * 1000000 + timeout.tv_usec;
+    if (usec != atomic_load_explicit(&runtime.flowlet_timeout, memory_order_relaxed)) {
+        logger(LOG_DEBUG, "Flowlet timeout adjusted to %u.%03u seconds.\n", timeout.tv_sec, timeout.tv_usec / 1000);
+        atomic_store_explicit(&runtime.flowlet_timeout, usec, memory_order_relaxed);
+    }
+}
+
+bool flowlet_table_create(struct flowlet_table *table) {
+    table->flowlets = calloc(FLOWLET_TABLE_SIZE, sizeof(struct flowlet));
+    return (table->flowlets != NULL);
+}
+
+void flowlet_table_destroy(void *arg) {
+    struct flowlet_table *table = (struct flowlet_table *)arg;
+    free(table->flowlets);
+    table->flowlets = NULL;
+}
+
+/* inner 5-tuple, fragments and packets without ports are hashed by their addresses and protocol only */
+static uint32_t flow_hash(unsigned char *packet, uint16_t size) {
+    uint32_t hash = 0;
+    uint32_t word;
+    int start, end;
+    int l4_offset = 0;
+    uint8_t protocol;
+    if ((size >= 20) && ((packet[0] >> 4) == 4)) {
+        start = 12;
+        end = 20;
+        protocol = packet[9];
+        if (((packet[6] & 0x3f) | packet[7]) == 0) /* not a fragment */
+            l4_offset = (packet[0] & 0x0f) * 4;
+    } else if ((size >= 40) && ((packet[0] >> 4) == 6)) {
+        start = 8;
+        end = 40;
+        protocol = packet[6];
+        l4_offset = 40;
+    } else {
+        return 0;
+    }
+    for (int i=start; i<end; i+=4) {
+        memcpy(&word, packet + i, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b1;
+    }
+    if ((l4_offset) && ((protocol == IPPROTO_TCP) || (protocol == IPPROTO_UDP)) && (l4_offset + 4 <= size)) {
+        memcpy(&word, packet + l4_offset, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b1;
+    }
+    return (hash ^ protocol) * 0x9e3779b1;
+}
+
+static inline bool scheduler_priority_port(unsigned char *l4) {
+    uint16_t source = (l4[0] << 8) | l4[1];
+    uint16_t destination = (l4[2] << 8) | l4[3];
+    return (runtime.upstream_priority.ports[source / 8] & (1 << (source % 8))) ||
+           (runtime.upstream_priority.ports[destination / 8] & (1 << (destination % 8)));
+}
+
+/* true for latency critical packets, by the dscp of the ip header or their tcp or udp ports */
+bool scheduler_priority(unsigned char *packet, uint16_t size) {
+    uint8_t dscp;
+    uint8_t protocol;
+    uint16_t offset;
+    bool first_fragment = true;
+
+    if ((size >= 20) && ((packet[0] >> 4) == 4)) {
+        dscp = packet[1] >> 2;
+        protocol = packet[9];
+        offset = (packet[0] & 0x0f) * 4;
+        first_fragment = ((((packet[6] << 8) | packet[7]) & 0x1fff) == 0);
+    } else if ((size >= 40) && ((packet[0] >> 4) == 6)) {
+        dscp = ((packet[0] & 0x0f) << 2) | (packet[1] >> 6);
+        protocol = packet[6];
+        offset = 40;
+        /* hop-by-hop, routing, fragment and destination options headers */
+        while (((protocol == 0) || (protocol == 43) || (protocol == 44) || (protocol == 60)) && (offset + 8 <= size)) {
+            if (protocol == 44) {
+                first_fragment = ((((packet[offset + 2] << 8) | packet[offset + 3]) & 0xfff8) == 0);
+                protocol = packet[offset];
+                offset += 8;
+            } else {
+                protocol = packet[offset];
+                offset += (packet[offset + 1] + 1) * 8;
+            }
+        }
+    } else {
+        return false;
+    }
+
+    if (runtime.upstream_priority.dscp & (1ULL << dscp))
+        return true;
+    if (((protocol == IPPROTO_TCP) || (protocol == IPPROTO_UDP)) && (first_fragment) && (offset + 4 <= size))
+        return scheduler_priority_port(packet + offset);
+    return false;
+}
+
+/* packets sent via from can't be overtaken by ones sent via to, it isn't faster */
+static bool scheduler_not_faster(uint8_t to, uint8_t from) {
+    struct timeval *to_rtt = (to == GRECP_TUNTYPE_LTE) ? &runtime.lte.smoothed_round_trip_time : &runtime.dsl.smoothed_round_trip_time;
+    struct timeval *from_rtt = (from == GRECP_TUNTYPE_LTE) ? &runtime.lte.smoothed_round_trip_time : &runtime.dsl.smoothed_round_trip_time;
+    return (timerisset(to_rtt)) && (timerisset(from_rtt)) && (!timercmp(to_rtt, from_rtt, <));
+}
+
+/* ns a packet sent via from takes longer to reach the haap than one sent via to, plus the jitter of from */
+static uint64_t scheduler_delay_difference(uint8_t to, uint8_t from) {
+    struct timeval *to_rtt = (to == GRECP_TUNTYPE_LTE) ? &runtime.lte.smoothed_round_trip_time : &runtime.dsl.smoothed_round_trip_time;
+    struct timeval *from_rtt = (from == GRECP_TUNTYPE_LTE) ? &runtime.lte.smoothed_round_trip_time : &runtime.dsl.smoothed_round_trip_time;
+    struct timeval *from_rttvar = (from == GRECP_TUNTYPE_LTE) ? &runtime.lte.round_trip_time_variation : &runtime.dsl.round_trip_time_variation;
+    uint64_t to_ns = (uint64_t)to_rtt->tv_sec * 1000000000 + to_rtt->tv_usec * 1000;
+    uint64_t from_ns = (uint64_t)from_rtt->tv_sec * 1000000000 + from_rtt->tv_usec * 1000;
+    uint64_t jitter = (uint64_t)from_rttvar->tv_sec * 1000000000 + from_rttvar->tv_usec * 1000;
+    return ((from_ns > to_ns) ? (from_ns - to_ns) / 2 : 0) + jitter;
+}
+
+/* dsl first, new flows overflow to lte once it is at its upstream rate
+ * flows that are busy on dsl stay there and push the others to lte, so dsl is always filled first
+ * flows on lte move back once their last packet there is expected at the haap before one sent via dsl now */
+static uint8_t scheduler_tunnel(uint8_t current, uint64_t last_sent, uint64_t now, uint16_t size, bool *overflowed) {
+    if (!runtime.dsl.tunnel_established)
+        return runtime.lte.tunnel_established ? GRECP_TUNTYPE_LTE : SCHEDULER_NO_TUNNEL;
+    /* without lte there's nowhere to overflow to, dsl has to queue them */
+    if (!runtime.lte.tunnel_established)
+        return GRECP_TUNTYPE_DSL;
+    /* until the round trip times are known flows stay for the flowlet timeout */
+    if ((current == GRECP_TUNTYPE_LTE) && (!scheduler_not_faster(GRECP_TUNTYPE_DSL, GRECP_TUNTYPE_LTE)) &&
+        ((!timerisset(&runtime.lte.smoothed_round_trip_time)) || (!timerisset(&runtime.dsl.smoothed_round_trip_time)) ||
+         (now - last_sent < scheduler_delay_difference(GRECP_TUNTYPE_DSL, GRECP_TUNTYPE_LTE))))
+        return GRECP_TUNTYPE_LTE;
+
+    uint32_t rate = scheduler_dsl_rate();
+    if ((rate == 0) || (token_bucket_take(&dsl_bucket, now, rate, size + SCHEDULER_OVERHEAD, false)))
+        return GRECP_TUNTYPE_DSL;
+    if (current == GRECP_TUNTYPE_DSL) {
+        token_bucket_take(&dsl_bucket, now, rate, size + SCHEDULER_OVERHEAD, true);
+        return GRECP_TUNTYPE_DSL;
+    }
+
+    *overflowed = true;
+    return GRECP_TUNTYPE_LTE;
+}
+
+/* when a packet sent now is expected at the haap: half the smoothed round trip time after its queue drained */
+static uint64_t scheduler_arrival(struct token_bucket *queue, struct timeval *srtt, uint32_t rate, uint64_t now, uint32_t size) {
+    uint64_t arrival = now + ((uint64_t)srtt->tv_sec * 1000000000 + srtt->tv_usec * 1000) / 2;
+    if (rate == 0)
+        return arrival;
+    uint64_t full_at = atomic_load_explicit(&queue->full_at, memory_order_relaxed);
+    return arrival + ((full_at > now) ? full_at - now : 0) + (uint64_t)size * 8000000 / rate;
+}
+
+/* the tunnel a packet is expected to reach the haap first
+ * a flow stays on its tunnel if the other one would deliver it ahead of the packets sent before */
+static uint8_t scheduler_earliest_arrival(uint8_t current, uint64_t last_arrival, uint64_t now, uint16_t size, bool *overflowed, uint64_t *arrival) {
+    uint32_t lte_rate = runtime.lte_upstream_rate;
+    uint32_t dsl_rate = scheduler_dsl_rate();
+    uint64_t lte = scheduler_arrival(&lte_bucket, &runtime.lte.smoothed_round_trip_time, lte_rate, now, size + SCHEDULER_OVERHEAD);
+    uint64_t dsl = scheduler_arrival(&dsl_bucket, &runtime.dsl.smoothed_round_trip_time, dsl_rate, now, size + SCHEDULER_OVERHEAD);
+    uint8_t tuntype = (lte < dsl) ? GRECP_TUNTYPE_LTE : GRECP_TUNTYPE_DSL;
+    if ((current != SCHEDULER_NO_TUNNEL) && (tuntype != current) && (((tuntype == GRECP_TUNTYPE_LTE) ? lte : dsl) < last_arrival))
+        tuntype = current;
+
+    if (tuntype == GRECP_TUNTYPE_LTE) {
+        if (lte_rate)
+            token_bucket_take(&lte_bucket, now, lte_rate, size + SCHEDULER_OVERHEAD, true);
+        *arrival = lte;
+        /* overflowed only if it's the dsl backlog that made lte win, not a lower round trip time */
+        uint64_t full_at = atomic_load_explicit(&dsl_bucket.full_at, memory_order_relaxed);
+        *overflowed = (dsl_rate) && (full_at > now) && (lte < dsl) && (dsl - (full_at - now) <= lte);
+    } else {
+        if (dsl_rate)
+            token_bucket_take(&dsl_bucket, now, dsl_rate, size + SCHEDULER_OVERHEAD, true);
+        *arrival = dsl;
+    }
+    return tuntype;
+}
+
+/* priority packets go via the tunnel with the lowest smoothed round trip time, regardless of its rate
+ * they are charged to its rate nevertheless, leaving what's left of it to everything else */
+static uint8_t scheduler_fastest(uint64_t now, uint16_t size) {
+    uint8_t tuntype;
+    if ((!runtime.lte.tunnel_established) || (!runtime.dsl.tunnel_established))
+        tuntype = runtime.dsl.tunnel_established ? GRECP_TUNTYPE_DSL : (runtime.lte.tunnel_established ? GRECP_TUNTYPE_LTE : SCHEDULER_NO_TUNNEL);
+    else if ((timerisset(&runtime.lte.smoothed_round_trip_time)) && (timerisset(&runtime.dsl.smoothed_round_trip_time)) &&
+             (timercmp(&runtime.lte.smoothed_round_trip_time, &runtime.dsl.smoothed_round_trip_time, <)))
+        tuntype = GRECP_TUNTYPE_LTE;
+    else
+        tuntype = GRECP_TUNTYPE_DSL;
+
+    uint32_t dsl_rate = scheduler_dsl_rate();
+    if ((tuntype == GRECP_TUNTYPE_DSL) && (dsl_rate))
+        token_bucket_take(&dsl_bucket, now, dsl_rate, size + SCHEDULER_OVERHEAD, true);
+    if ((tuntype == GRECP_TUNTYPE_LTE) && (runtime.lte_upstream_rate))
+        token_bucket_take(&lte_bucket, now, runtime.lte_upstream_rate, size + SCHEDULER_OVERHEAD, true);
+    return tuntype;
+}
+
+void scheduler_reset() {
+    atomic_store(&dsl_bucket.full_at, 0);
+    atomic_store(&lte_bucket.full_at, 0);
+}
+
+/* returns the tunnel type to send an ip packet via, or SCHEDULER_NO_TUNNEL if all tunnels are down */
+uint8_t scheduler_pick(struct flowlet_table *table, unsigned char *packet, uint16_t size, bool priority, bool *overflowed) {
+    *overflowed = false;
+    uint64_t now = scheduler_now();
+    if (priority)
+        return scheduler_fastest(now, size);
+    bool earliest_arrival = (runtime.upstream_scheduler == UPSTREAM_SCHEDULER_EARLIEST_ARRIVAL) &&
+                            (runtime.lte.tunnel_established) && (runtime.dsl.tunnel_established) &&
+                            (timerisset(&runtime.lte.smoothed_round_trip_time)) && (timerisset(&runtime.dsl.smoothed_round_trip_time));
+
+    /* flows are tracked until they were idle for the flowlet timeout, or until their last packet arrived */
+    struct flowlet *flowlet = NULL;
+    uint8_t current = SCHEDULER_NO_TUNNEL;
+    uint64_t timeout = atomic_load_explicit(&runtime.flowlet_timeout, memory_order_relaxed) * 1000;
+    if (timeout) {
+        uint32_t hash = flow_hash(packet, size);
+        flowlet = &table->flowlets[hash >> (32 - FLOWLET_TABLE_BITS)];
+        if ((flowlet->hash == hash) && (flowlet->last_sent) && ((earliest_arrival) ? (flowlet->arrival > now) : (now - flowlet->last_sent < timeout)))
+            current = flowlet->tuntype;
+        flowlet->hash = hash;
+    }
+
+    uint8_t tuntype;
+    uint64_t arrival = 0;
+    if (earliest_arrival)
+        tuntype = scheduler_earliest_arrival(current, flowlet ? flowlet->arrival : 0, now, size, overflowed, &arrival);
+    else
+        tuntype = scheduler_tunnel(current, flowlet ? flowlet->last_sent : 0, now, size, overflowed);
+
+    if (flowlet) {
+        flowlet->tuntype = tuntype;
+        flowlet->last_sent = now;
+        flowlet->arrival = arrival;
+    }
+    return tuntype;
+}
\ No newline at end of file
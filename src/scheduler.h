@@ -0,0 +1,55 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* ipv6 and gre header with key and sequence number, sent along with every packet and counted against the link rate */
+#define SCHEDULER_OVERHEAD (40 + 12)
+
+/* picked if all tunnels are down, GRECP_TUNTYPE_LTE is 0 */
+#define SCHEDULER_NO_TUNNEL 0xff
+
+/* token bucket in virtual time, all of its state is the time it will be full again
+ * so it is shared lock free by the sender threads of all tun device queues
+ * without a burst limit the same time is when a queue sending at its rate drains */
+struct token_bucket {
+    _Atomic uint64_t full_at; /* ns, CLOCK_MONOTONIC */
+};
+
+/* tunnel each flow last sent a packet via, indexed by a hash of its 5-tuple
+ * every sender thread has one of its own, the tun device keeps flows on the same queue */
+/* adaptive flowlet timeout until the round trip times of both tunnels are known, in us */
+#define FLOWLET_TIMEOUT_DEFAULT (100 * 1000)
+
+#define FLOWLET_TABLE_BITS 12
+#define FLOWLET_TABLE_SIZE (1 << FLOWLET_TABLE_BITS)
+
+struct flowlet {
+    uint64_t last_sent; /* ns, CLOCK_MONOTONIC */
+    uint64_t arrival; /* ns, when the last packet is expected at the haap, earliest arrival scheduler only */
+    uint32_t hash;
+    uint8_t tuntype;
+};
+
+struct flowlet_table {
+    struct flowlet *flowlets;
+};
+
+uint32_t scheduler_dsl_rate();
+void update_flowlet_timeout();
+bool flowlet_table_create(struct flowlet_table *table);
+void flowlet_table_destroy(void *arg);
+void scheduler_reset();
+bool scheduler_priority(unsigned char *packet, uint16_t size);
+uint8_t scheduler_pick(struct flowlet_table *table, unsigned char *packet, uint16_t size, bool priority, bool *overflowed);
\ No newline at end of file
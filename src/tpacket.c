@@ -0,0 +1,165 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "openhybrid.h"
+#include <linux/filter.h>
+#include <net/ethernet.h>
+#include <sys/mman.h>
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23
+#endif
+
+static bool tpacket_open_socket(struct tpacket_socket *s, char *interface_name) {
+    if ((s->ifindex = if_nametoindex(interface_name)) == 0) {
+        logger(LOG_ERROR, "Packet socket: Interface '%s' not found.\n", interface_name);
+        return false;
+    }
+
+    /* SOCK_DGRAM strips the link layer header, every frame starts with the ipv6 header
+     * no protocol yet, it only starts receiving once bound to the interface, not with frames of all of them */
+    if ((s->fd = socket(AF_PACKET, SOCK_DGRAM, 0)) < 0) {
+        logger(LOG_ERROR, "Creation of packet socket failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* BPF filter to only get ipv4/6 data messages of the haap for our tunnel */
+    struct sock_filter bpfcode[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6), /* load ip6->next_header */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_GRE, 0, 17), /* skip next 17 lines if it's != IPPROTO_GRE */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8), /* load ip6->saddr */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[0]), 0, 15), /* skip next 15 lines if it's != runtime.haap.ip */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[1]), 0, 13),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 16),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[2]), 0, 11),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 20),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[3]), 0, 9),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 40), /* load gre->flags_and_version */
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, ~(GRECP_FLAGSANDVERSION_WITH_SEQ ^ GRECP_FLAGSANDVERSION) & 0xffff), /* ignore the sequence flag */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, GRECP_FLAGSANDVERSION, 0, 6), /* skip next 6 lines if it's != GRECP_FLAGSANDVERSION */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 40 + 4), /* load gre->key */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, runtime.haap.bonding_key, 0, 4), /* skip next 4 lines if it's != runtime.haap.bonding_key */
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 40 + 2), /* load gre->proto */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IP, 1, 0), /* skip next line if it's == ETHERTYPE_IP  */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 0, 1), /* skip next line if it's != ETHERTYPE_IPV6  */
+        BPF_STMT(BPF_RET | BPF_K, -1), /* accept packet */
+        BPF_STMT(BPF_RET | BPF_K, 0), /* discard packet */
+    };
+    struct sock_fprog bpfprog = {
+        .len = 20,
+        .filter = bpfcode,
+    };
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ATTACH_FILTER, &bpfprog, sizeof(bpfprog)) < 0) {
+        logger(LOG_ERROR, "Attaching BPF failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* our own packets to the haap would match as well */
+    int enable = 1;
+    setsockopt(s->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &enable, sizeof(enable));
+
+    int version = TPACKET_V3;
+    struct tpacket_req3 req = {
+        .tp_block_size = TPACKET_BLOCK_SIZE,
+        .tp_block_nr = TPACKET_BLOCK_COUNT,
+        .tp_frame_size = TPACKET_FRAME_SIZE,
+        .tp_frame_nr = TPACKET_BLOCK_SIZE / TPACKET_FRAME_SIZE * TPACKET_BLOCK_COUNT,
+        .tp_retire_blk_tov = TPACKET_BLOCK_TIMEOUT,
+    };
+    if ((setsockopt(s->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) ||
+        (setsockopt(s->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)) {
+        logger(LOG_ERROR, "Configuration of packet socket ring failed: %s\n", strerror(errno));
+        return false;
+    }
+    s->ring = mmap(NULL, (size_t)TPACKET_BLOCK_SIZE * TPACKET_BLOCK_COUNT, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->ring == MAP_FAILED) {
+        s->ring = NULL;
+        logger(LOG_ERROR, "Mapping packet socket ring failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct sockaddr_ll addr = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_IPV6),
+        .sll_ifindex = s->ifindex,
+    };
+    if (bind(s->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        logger(LOG_ERROR, "Binding packet socket to interface '%s' failed: %s\n", interface_name, strerror(errno));
+        return false;
+    }
+
+    logger(LOG_INFO, "Packet socket: Receiving gre packets on interface '%s'.\n", interface_name);
+    return true;
+}
+
+static void tpacket_close_socket(struct tpacket_socket *s) {
+    if (s->ring)
+        munmap(s->ring, (size_t)TPACKET_BLOCK_SIZE * TPACKET_BLOCK_COUNT);
+    if (s->fd >= 0)
+        close(s->fd);
+}
+
+/* an interface that can't be set up is left to the raw socket */
+static void tpacket_open_interface(struct tpacket *tpacket, char *interface_name, uint8_t tuntype) {
+    struct tpacket_socket *s = &tpacket->sockets[tpacket->count];
+    s->fd = -1;
+    s->ring = NULL;
+    s->block = 0;
+    s->tuntype = tuntype;
+    if (!tpacket_open_socket(s, interface_name)) {
+        tpacket_close_socket(s);
+        return;
+    }
+    tpacket->count++;
+}
+
+/* set up packet sockets on the lte and dsl interfaces */
+bool tpacket_open(struct tpacket *tpacket) {
+    tpacket->count = 0;
+    tpacket_open_interface(tpacket, runtime.lte.interface_name, GRECP_TUNTYPE_LTE);
+    if (strlen(runtime.dsl.interface_name) > 0)
+        tpacket_open_interface(tpacket, runtime.dsl.interface_name, GRECP_TUNTYPE_DSL);
+    if (tpacket->count == 0)
+        return false;
+
+    int ifindexes[2];
+    for (int i=0; i<tpacket->count; i++)
+        ifindexes[i] = tpacket->sockets[i].ifindex;
+    ignore_gre_socket_interfaces(ifindexes, tpacket->count);
+    return true;
+}
+
+void tpacket_close(void *arg) {
+    struct tpacket *tpacket = (struct tpacket *)arg;
+    for (int i=0; i<tpacket->count; i++)
+        tpacket_close_socket(&tpacket->sockets[i]);
+    tpacket->count = 0;
+}
+
+/* returns the next block filled by the kernel, NULL if there is none yet */
+struct tpacket_block_desc *tpacket_block(struct tpacket_socket *s) {
+    struct tpacket_block_desc *block = (struct tpacket_block_desc *)(s->ring + (size_t)s->block * TPACKET_BLOCK_SIZE);
+    if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+        return NULL;
+    return block;
+}
+
+/* hand the block back to the kernel, its packets must not be looked at anymore */
+void tpacket_block_release(struct tpacket_socket *s, struct tpacket_block_desc *block) {
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    s->block = (s->block + 1) % TPACKET_BLOCK_COUNT;
+}
\ No newline at end of file
@@ -0,0 +1,45 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <linux/if_packet.h>
+
+/* ring of each packet socket, blocks are handed back and forth with the kernel as a whole */
+#define TPACKET_BLOCK_SIZE (1 << 16)
+#define TPACKET_BLOCK_COUNT 32
+#define TPACKET_FRAME_SIZE 2048
+
+/* partially filled blocks are handed to us after this many milli seconds */
+#define TPACKET_BLOCK_TIMEOUT 1
+
+struct tpacket_socket {
+    int fd;
+    int ifindex;
+    uint8_t tuntype;
+    unsigned char *ring;
+    /* next block to look at, the kernel fills them in order */
+    uint32_t block;
+};
+
+struct tpacket {
+    struct tpacket_socket sockets[2];
+    uint8_t count;
+};
+
+/* returns false if no interface could be set up */
+bool tpacket_open(struct tpacket *tpacket);
+void tpacket_close(void *arg);
+struct tpacket_block_desc *tpacket_block(struct tpacket_socket *s);
+void tpacket_block_release(struct tpacket_socket *s, struct tpacket_block_desc *block);
\ No newline at end of file
@@ -24,129 +24,667 @@
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/udp.h>
+#include <poll.h>
+#include <stdatomic.h>
 
-void send_gre(uint8_t tuntype, uint16_t proto, uint32_t sequence, bool include_sequence, void *payload, uint16_t payload_size) {
-    unsigned char buffer[MAX_PKT_SIZE] = {};
-    int size = 0;
+#include <sys/eventfd.h>
 
-    /* GRE header */
-    struct grehdr *greh = (struct grehdr *)(buffer + size);
-    greh->flags_and_version = htons(GRECP_FLAGSANDVERSION);
-    greh->proto = htons(proto);
-    greh->key = htonl(runtime.haap.bonding_key);
-    size += sizeof(struct grehdr);
-    /* Sequence */
-    if (include_sequence) {
-        greh->flags_and_version = htons(GRECP_FLAGSANDVERSION_WITH_SEQ);
-        sequence = htonl(sequence);
-        memcpy(buffer + size, &sequence, sizeof(sequence));
-        size += sizeof(sequence);
+struct gre_seq_hdr {
+    struct grehdr gre;
+    uint32_t sequence;
+};
+
+/* gre sequence numbers are shared by the threads of all tun device queues */
+static _Atomic uint32_t sequence;
+
+struct send_batch {
+    uint8_t tuntype;
+    int fd;
+    /* template shared by all messages of the batch, rebuilt if addresses change */
+    struct in6_addr src;
+    struct sockaddr_in6 dst;
+    unsigned char control[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    /* gre header template, rebuilt if the bonding key changes */
+    struct gre_seq_hdr header;
+    uint32_t bonding_key;
+    /* each message is sent as gre header (iovec 0) and packet read from the tun device (iovec 1) */
+    struct mmsghdr *msgs;
+    struct iovec *iovecs;
+    struct gre_seq_hdr *headers;
+    unsigned int count;
+    /* added to the statistics when the batch is flushed */
+    uint64_t bytes;
+};
+
+static void send_batch_init(struct send_batch *batch, uint8_t tuntype, int fd) {
+    batch->tuntype = tuntype;
+    batch->fd = fd;
+    batch->dst.sin6_family = AF_INET6;
+    batch->msgs = calloc(runtime.send_batch_size, sizeof(struct mmsghdr));
+    batch->iovecs = calloc(runtime.send_batch_size * 2, sizeof(struct iovec));
+    batch->headers = calloc(runtime.send_batch_size, sizeof(struct gre_seq_hdr));
+
+    batch->header.gre.flags_and_version = htons(GRECP_FLAGSANDVERSION_WITH_SEQ);
+    batch->header.gre.key = htonl(runtime.haap.bonding_key);
+    batch->bonding_key = runtime.haap.bonding_key;
+
+    struct cmsghdr *c;
+    for (int i=0; i<runtime.send_batch_size; i++) {
+        batch->iovecs[i * 2].iov_base = &batch->headers[i];
+        batch->iovecs[i * 2].iov_len = sizeof(struct gre_seq_hdr);
+        batch->msgs[i].msg_hdr.msg_name = &batch->dst;
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i * 2];
+        batch->msgs[i].msg_hdr.msg_iovlen = 2;
+        batch->msgs[i].msg_hdr.msg_control = batch->control;
+        batch->msgs[i].msg_hdr.msg_controllen = CMSG_LEN(sizeof(struct in6_pktinfo));
     }
+    c = CMSG_FIRSTHDR(&batch->msgs[0].msg_hdr);
+    c->cmsg_level = IPPROTO_IPV6;
+    c->cmsg_type = IPV6_PKTINFO;
+    c->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+}
 
-    /* Payload */
-    memcpy(buffer + size, payload, payload_size);
-    size += payload_size;
+static void send_batch_destroy(void *arg) {
+    struct send_batch *batch = (struct send_batch *)arg;
+    free(batch->msgs);
+    free(batch->iovecs);
+    free(batch->headers);
+}
+
+static void send_batch_flush(struct send_batch *batch) {
+    if (batch->count == 0)
+        return;
 
     /* Source & Destination */
-    struct sockaddr_in6 src = {};
-    src.sin6_family = AF_INET6;
-    if (tuntype == GRECP_TUNTYPE_LTE) {
-        src.sin6_addr = runtime.lte.interface_ip;
+    struct in6_addr *src;
+    if (batch->tuntype == GRECP_TUNTYPE_LTE) {
+        src = &runtime.lte.interface_ip;
     } else {
-        src.sin6_addr = runtime.dsl.interface_ip;
+        src = &runtime.dsl.interface_ip;
+    }
+    if ((memcmp(&batch->src, src, sizeof(struct in6_addr)) != 0) || (memcmp(&batch->dst.sin6_addr, &runtime.haap.ip, sizeof(struct in6_addr)) != 0)) {
+        batch->src = *src;
+        batch->dst.sin6_addr = runtime.haap.ip;
+        struct in6_pktinfo *pi = (struct in6_pktinfo *)CMSG_DATA(CMSG_FIRSTHDR(&batch->msgs[0].msg_hdr));
+        pi->ipi6_addr = batch->src;
+        pi->ipi6_ifindex = 0;
     }
-    struct sockaddr_in6 dst = {};
-    dst.sin6_family = AF_INET6;
-    dst.sin6_addr = runtime.haap.ip;
 
-    /* Construct control information */
-    struct msghdr msgh = {};
-    struct iovec msgiov = {};
-    struct cmsghdr *c;
-    struct unp_in_pktinfo {
-        struct in6_addr ipi6_addr;
-        int ipi6_ifindex;
-    } *pi;
-    msgh.msg_name = &dst;
-    msgh.msg_namelen = sizeof(struct sockaddr_in6);
-    msgiov.iov_base = buffer;
-    msgiov.iov_len = size;
-    msgh.msg_iov = &msgiov;
-    msgh.msg_iovlen = 1;
-    unsigned char control_buf[CMSG_LEN(sizeof(struct unp_in_pktinfo))] = {};
-    msgh.msg_control = &control_buf;
-    msgh.msg_controllen = CMSG_LEN(sizeof(struct unp_in_pktinfo));
-    c = CMSG_FIRSTHDR(&msgh);
-    c->cmsg_level = IPPROTO_IPV6;
-    c->cmsg_type = IPV6_PKTINFO;
-    c->cmsg_len = CMSG_LEN(sizeof(struct unp_in_pktinfo));
-    pi = (struct unp_in_pktinfo *)CMSG_DATA(c);
-    pi->ipi6_addr = src.sin6_addr;
-    msgh.msg_controllen = c->cmsg_len;
+    int sent = 0;
+    int res;
+    struct pollfd pfd = { .fd = batch->fd, .events = POLLOUT };
+    while (sent < batch->count) {
+        res = sendmmsg(batch->fd, batch->msgs + sent, batch->count - sent, 0);
+        if ((res < 0) && (errno == EAGAIN)) {
+            /* tunnel sockets of sender threads don't block, only this tunnel waits for room */
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (res <= 0) {
+            logger(LOG_ERROR, "Raw socket send failed: %s\n", strerror(errno));
+            break;
+        }
+        sent += res;
+    }
 
-    if (sendmsg(sockfd_gre, &msgh, 0) <= 0) {
-        logger(LOG_ERROR, "Raw socket send failed: %s\n", strerror(errno));
+    /* only what left before a hard error counts as sent */
+    uint64_t bytes = batch->bytes;
+    if (sent < batch->count) {
+        bytes = 0;
+        for (int i=0; i<sent; i++)
+            bytes += batch->iovecs[i * 2 + 1].iov_len;
+    }
+    if (batch->tuntype == GRECP_TUNTYPE_LTE) {
+        atomic_fetch_add_explicit(&runtime.stats.lte_sent_packets, sent, memory_order_relaxed);
+        atomic_fetch_add_explicit(&runtime.stats.lte_sent_bytes, bytes, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&runtime.stats.dsl_sent_packets, sent, memory_order_relaxed);
+        atomic_fetch_add_explicit(&runtime.stats.dsl_sent_bytes, bytes, memory_order_relaxed);
     }
+    batch->count = 0;
+    batch->bytes = 0;
 }
 
-void *tun2gre_main() {
-    char trimifname[IF_NAMESIZE-6];
-    char threadname[IF_NAMESIZE];
-    strncpy(trimifname, runtime.tunnel_interface_name, IF_NAMESIZE-7);
-    sprintf(threadname, "%s-send", trimifname);
-    pthread_setname_np(pthread_self(), threadname);
+/* payload is referenced, not copied, it has to stay untouched until the batch is flushed */
+static void send_batch_add(struct send_batch *batch, uint16_t proto, uint32_t sequence, void *payload, uint16_t payload_size) {
+    /* segmented packets may add more than a batch per read round */
+    if (batch->count == runtime.send_batch_size)
+        send_batch_flush(batch);
 
-    unsigned char buffer[MAX_PKT_SIZE];
-    ssize_t size;
+    if (batch->bonding_key != runtime.haap.bonding_key) {
+        batch->bonding_key = runtime.haap.bonding_key;
+        batch->header.gre.key = htonl(batch->bonding_key);
+    }
+
+    /* GRE header */
+    struct gre_seq_hdr *header = &batch->headers[batch->count];
+    *header = batch->header;
+    header->gre.proto = htons(proto);
+    header->sequence = htonl(sequence);
+
+    /* Payload */
+    batch->iovecs[batch->count * 2 + 1].iov_base = payload;
+    batch->iovecs[batch->count * 2 + 1].iov_len = payload_size;
+    batch->count++;
+    batch->bytes += payload_size;
+}
+
+/* packets handed to a tunnel sender are copied into a slot of the pool of the tun device queue they were read from
+ * their sequence number is taken when they are sent, priority packets overtake the queued ones */
+struct queued_packet {
+    uint16_t proto;
+    unsigned char payload[MAX_PKT_SIZE];
+};
+
+/* with send queues every tunnel gets a sender thread and a non-blocking socket of its own
+ * a tunnel that can't keep up fills its queues, it doesn't hold up the other one */
+struct tunnel_sender {
+    pthread_t thread;
+    bool started;
+    int eventfd;
+    struct send_batch batch;
+    /* two queues per tun device queue, priority ones are sent first, and their slots going back to be put into its pool */
+    struct ring packets[MAX_TUNNEL_QUEUES];
+    struct ring priority[MAX_TUNNEL_QUEUES];
+    struct ring returned[MAX_TUNNEL_QUEUES];
+    /* tun device queue each packet of the batch was read from */
+    uint8_t *queues;
+};
+
+struct tunnel_senders {
+    struct tunnel_sender lte;
+    struct tunnel_sender dsl;
+    struct packet_pool pools[MAX_TUNNEL_QUEUES];
+    bool active;
+};
+
+static struct tunnel_senders senders;
+
+/* state of the thread reading one tun device queue */
+struct tun2gre_reader {
+    uint8_t queue;
+    /* without send queues packets are sent by the reader itself */
+    struct send_batch lte_batch;
+    struct send_batch dsl_batch;
+    struct flowlet_table flowlets;
+    /* mtu sized segments of gso packets, they have to stay untouched until both batches are flushed */
+    unsigned char *segments;
+    unsigned int segment_count;
+    unsigned int segment_max;
+    /* tunnel senders to wake up, and statistics, at the end of the read round */
+    bool lte_pending;
+    bool dsl_pending;
+    unsigned int overflowed;
+    unsigned int priority;
+    unsigned int lte_dropped;
+    unsigned int dsl_dropped;
+    unsigned int queue_overflowed;
+};
+
+/* put slots of sent packets back into the pool */
+static void tun2gre_reclaim(struct tun2gre_reader *r) {
+    void *packet;
+    uint16_t size;
+    while (ring_pop(&senders.lte.returned[r->queue], &packet, &size))
+        pool_put(&senders.pools[r->queue], packet);
+    while (ring_pop(&senders.dsl.returned[r->queue], &packet, &size))
+        pool_put(&senders.pools[r->queue], packet);
+}
+
+/* copy a packet into a slot of our pool and queue it for the sender of its tunnel
+ * if its queue is full it's dropped, or queued for the other tunnel with the overflow policy */
+static void tun2gre_enqueue(struct tun2gre_reader *r, uint8_t tuntype, bool priority, uint16_t proto, void *payload, uint16_t payload_size) {
+    struct tunnel_sender *s = (tuntype == GRECP_TUNTYPE_LTE) ? &senders.lte : &senders.dsl;
+    struct tunnel_sender *other = (tuntype == GRECP_TUNTYPE_LTE) ? &senders.dsl : &senders.lte;
+    bool other_established = (tuntype == GRECP_TUNTYPE_LTE) ? runtime.dsl.tunnel_established : runtime.lte.tunnel_established;
+    struct ring *ring = priority ? &s->priority[r->queue] : &s->packets[r->queue];
+
+    /* rings are rounded up to a power of two, the configured size is what the pools are sized for */
+    if (ring_count(ring) >= runtime.send_queue_size) {
+        struct ring *other_ring = priority ? &other->priority[r->queue] : &other->packets[r->queue];
+        if ((runtime.send_queue_policy == SEND_QUEUE_POLICY_OVERFLOW) && (other_established) && (ring_count(other_ring) < runtime.send_queue_size)) {
+            s = other;
+            ring = other_ring;
+            r->queue_overflowed++;
+        } else {
+            if (tuntype == GRECP_TUNTYPE_LTE)
+                r->lte_dropped++;
+            else
+                r->dsl_dropped++;
+            return;
+        }
+    }
+    struct queued_packet *packet = pool_get(&senders.pools[r->queue]);
+    if (!packet) {
+        tun2gre_reclaim(r);
+        if ((packet = pool_get(&senders.pools[r->queue])) == NULL) {
+            if (s == &senders.lte)
+                r->lte_dropped++;
+            else
+                r->dsl_dropped++;
+            return;
+        }
+    }
+
+    packet->proto = proto;
+    memcpy(packet->payload, payload, payload_size);
+    ring_push(ring, packet, payload_size);
+    if (s == &senders.lte)
+        r->lte_pending = true;
+    else
+        r->dsl_pending = true;
+    /* don't wait for the end of the read round for priority packets, or gso packets filling a queue in one go */
+    if (((priority) && (ring_count(ring) == 1)) || (ring_count(ring) == runtime.send_queue_size / 2))
+        eventfd_write(s->eventfd, 1);
+}
+
+/* pick a tunnel for a single ip packet and add it to its batch */
+static void tun2gre_send(struct tun2gre_reader *r, unsigned char *buffer, uint16_t size) {
     uint16_t etherproto;
-    uint32_t sequence = 0;
     struct iphdr *iph;
     struct ip6_hdr *ip6h;
     struct udphdr *udph;
-    bool is_dhcp;
+    bool is_dhcp = false;
+    bool priority = false;
+    bool overflowed = false;
+    uint8_t tuntype;
+    struct send_batch *batch;
+
+    /* determine packet type */
+    iph = (struct iphdr *)buffer;
+    if (iph->version == 4) {
+        etherproto = ETHERTYPE_IP;
+    } else if (iph->version == 6) {
+        etherproto = ETHERTYPE_IPV6;
+        ip6h = (struct ip6_hdr *)buffer;
+    } else {
+        /* ignore unsupported protocols */
+        return;
+    }
+
+    /* check if it's a dhcp packet */
+    if ((etherproto == ETHERTYPE_IP) && (iph->protocol == IPPROTO_UDP)) {
+            udph = (struct udphdr *)(buffer + sizeof(struct iphdr));
+            if ((ntohs(udph->uh_sport) == 68) && (ntohs(udph->uh_dport) == 67))
+                is_dhcp = true;
+    } else if ((etherproto == ETHERTYPE_IPV6) && (ip6h->ip6_ctlun.ip6_un1.ip6_un1_nxt == IPPROTO_UDP)) {
+            udph = (struct udphdr *)(buffer + sizeof(struct ip6_hdr));
+            if ((ntohs(udph->uh_sport) == 546) && (ntohs(udph->uh_dport) == 547))
+                is_dhcp = true;
+    }
+
+    /* dhcp goes via lte, priority packets via the faster tunnel, everything else fills dsl up to its upstream rate and overflows to lte */
+    if (is_dhcp) {
+        tuntype = runtime.lte.tunnel_established ? GRECP_TUNTYPE_LTE : SCHEDULER_NO_TUNNEL;
+    } else {
+        priority = scheduler_priority(buffer, size);
+        tuntype = scheduler_pick(&r->flowlets, buffer, size, priority, &overflowed);
+    }
+
+    if (tuntype == SCHEDULER_NO_TUNNEL) {
+        logger(LOG_ERROR, "Sending packet failed: All tunnels are down");
+        return;
+    }
+    if (tuntype == GRECP_TUNTYPE_DSL) {
+        logger(LOG_CRAZYDEBUG, "tun2gre: Sending %u bytes via DSL\n", size);
+    } else {
+        logger(LOG_CRAZYDEBUG, "tun2gre: Sending %u bytes via LTE%s\n", size, overflowed ? ", DSL is at its upstream rate" : "");
+        if (overflowed)
+            r->overflowed++;
+    }
+    if (priority)
+        r->priority++;
+
+    if (senders.active) {
+        tun2gre_enqueue(r, tuntype, priority, etherproto, buffer, size);
+        return;
+    }
+    batch = (tuntype == GRECP_TUNTYPE_LTE) ? &r->lte_batch : &r->dsl_batch;
+    send_batch_add(batch, etherproto, atomic_fetch_add_explicit(&sequence, 1, memory_order_relaxed), buffer, size);
+    /* priority packets don't wait for the rest of the read round */
+    if (priority)
+        send_batch_flush(batch);
+}
+
+/* end of a read round, or the segments of gso packets are used up */
+static void tun2gre_flush(struct tun2gre_reader *r) {
+    send_batch_flush(&r->dsl_batch);
+    send_batch_flush(&r->lte_batch);
+    r->segment_count = 0;
+
+    if (r->dsl_pending)
+        eventfd_write(senders.dsl.eventfd, 1);
+    if (r->lte_pending)
+        eventfd_write(senders.lte.eventfd, 1);
+    r->dsl_pending = false;
+    r->lte_pending = false;
+    if (senders.active)
+        tun2gre_reclaim(r);
+
+    atomic_fetch_add_explicit(&runtime.stats.dsl_overflowed, r->overflowed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&runtime.stats.upstream_priority_packets, r->priority, memory_order_relaxed);
+    atomic_fetch_add_explicit(&runtime.stats.lte_send_queue_dropped, r->lte_dropped, memory_order_relaxed);
+    atomic_fetch_add_explicit(&runtime.stats.dsl_send_queue_dropped, r->dsl_dropped, memory_order_relaxed);
+    atomic_fetch_add_explicit(&runtime.stats.send_queue_overflowed, r->queue_overflowed, memory_order_relaxed);
+    r->overflowed = 0;
+    r->priority = 0;
+    r->lte_dropped = 0;
+    r->dsl_dropped = 0;
+    r->queue_overflowed = 0;
+}
+
+/* a packet read from the tun device, with offloads it is preceded by a vnet header */
+static void tun2gre_read(struct tun2gre_reader *r, unsigned char *buffer, ssize_t size) {
+    unsigned char *segment;
+    uint16_t segment_size;
+    struct virtio_net_hdr vnet;
+    struct gso_segmenter gso;
+
+    if (!runtime.tunnel_offload) {
+        tun2gre_send(r, buffer, size);
+        return;
+    }
+
+    if (size <= sizeof(struct virtio_net_hdr))
+        return;
+    memcpy(&vnet, buffer, sizeof(struct virtio_net_hdr));
+    buffer += sizeof(struct virtio_net_hdr);
+    size -= sizeof(struct virtio_net_hdr);
+
+    /* the haap doesn't know about offloads, so checksums have to be complete and packets mtu sized */
+    if (vnet.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+        if ((size <= MAX_PKT_SIZE) && (checksum_complete(&vnet, buffer, size)))
+            tun2gre_send(r, buffer, size);
+        return;
+    }
+    if (!gso_init(&gso, &vnet, buffer, size)) {
+        logger(LOG_DEBUG, "tun2gre: Dropping gso packet of unsupported type %u\n", vnet.gso_type);
+        return;
+    }
     while (true) {
-        is_dhcp = false;
-
-        size = read(sockfd_tun, buffer, MAX_PKT_SIZE);
-        if (size > 0) {
-            //logger_hexdump(LOG_DEBUG, buffer, size, "buffer:");
-
-            /* determine packet type */
-            iph = (struct iphdr *)buffer;
-            if (iph->version == 4) {
-                etherproto = ETHERTYPE_IP;
-            } else if (iph->version == 6) {
-                etherproto = ETHERTYPE_IPV6;
-                ip6h = (struct ip6_hdr *)buffer;
-            } else {
-                /* ignore unsupported protocols */
-                continue;
-            }
+        if (r->segment_count == r->segment_max)
+            tun2gre_flush(r);
+        segment = r->segments + (size_t)r->segment_count * MAX_PKT_SIZE;
+        if ((segment_size = gso_next(&gso, segment)) == 0)
+            break;
+        r->segment_count++;
+        tun2gre_send(r, segment, segment_size);
+    }
+}
 
-            /* check if it's a dhcp packet */
-            if ((etherproto == ETHERTYPE_IP) && (iph->protocol == IPPROTO_UDP)) {
-                    udph = (struct udphdr *)(buffer + sizeof(struct iphdr));
-                    if ((ntohs(udph->uh_sport) == 68) && (ntohs(udph->uh_dport) == 67))
-                        is_dhcp = true;
-            } else if ((etherproto == ETHERTYPE_IPV6) && (ip6h->ip6_ctlun.ip6_un1.ip6_un1_nxt == IPPROTO_UDP)) {
-                    udph = (struct udphdr *)(buffer + sizeof(struct ip6_hdr));
-                    if ((ntohs(udph->uh_sport) == 546) && (ntohs(udph->uh_dport) == 547))
-                        is_dhcp = true;
-            }
-            is_dhcp = true;
-
-            if ((!is_dhcp) && (runtime.dsl.tunnel_established)) {
-                /* TODO: implement overflow to LTE */
-                logger(LOG_CRAZYDEBUG, "tun2gre: Sending %u bytes via DSL\n", size);
-                send_gre(GRECP_TUNTYPE_DSL, etherproto, sequence++, true, buffer, size);
-            } else if (runtime.lte.tunnel_established) {
-                logger(LOG_CRAZYDEBUG, "tun2gre: Sending %u bytes via LTE\n", size);
-                send_gre(GRECP_TUNTYPE_LTE, etherproto, sequence++, true, buffer, size);
-            } else {
-                logger(LOG_ERROR, "Sending packet failed: All tunnels are down");
-            }
+/* one read per packet slot, all submitted at once with a single system call
+ * io_uring would wait for packets, so reads are done right away and the ones past the last queued packet fail with EAGAIN */
+static bool tun2gre_uring_open(struct uring *ring, int fd, unsigned char *packets, size_t slot_size) {
+    return (uring_open(ring, runtime.send_batch_size)) && (uring_register_files(ring, &fd, 1)) &&
+           (uring_register_buffer(ring, packets, (size_t)runtime.send_batch_size * slot_size));
+}
+
+static void tun2gre_uring_read(struct uring *ring, struct tun2gre_reader *r, unsigned char *packets, size_t slot_size) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    for (int i=0; i<runtime.send_batch_size; i++) {
+        sqe = uring_sqe(ring);
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = (uintptr_t)(packets + (size_t)i * slot_size);
+        sqe->len = slot_size;
+        sqe->buf_index = 0;
+        sqe->rw_flags = RWF_NOWAIT;
+        sqe->user_data = i;
+    }
+    int remaining = runtime.send_batch_size;
+    int res = uring_submit(ring, remaining);
+    while ((res >= 0) && (remaining > 0)) {
+        if ((cqe = uring_cqe(ring)) == NULL) {
+            res = uring_submit(ring, 1);
+            continue;
+        }
+        if (cqe->res > 0)
+            tun2gre_read(r, packets + cqe->user_data * slot_size, cqe->res);
+        else if (cqe->res != -EAGAIN)
+            logger(LOG_ERROR, "Tun device read failed: %s\n", strerror(-cqe->res));
+        uring_cqe_seen(ring);
+        remaining--;
+    }
+    if (res < 0)
+        logger(LOG_ERROR, "Tun device read submission failed: %s\n", strerror(errno));
+}
+
+static void tun2gre_reader_destroy(void *arg) {
+    struct tun2gre_reader *r = (struct tun2gre_reader *)arg;
+    send_batch_destroy(&r->lte_batch);
+    send_batch_destroy(&r->dsl_batch);
+    flowlet_table_destroy(&r->flowlets);
+    free(r->segments);
+}
+
+/* read packets from one tun device queue and send them via the tunnels, never returns */
+static void tun2gre_queue(uint8_t queue) {
+    int fd = sockfd_tun_queues[queue];
+    struct tun2gre_reader r = {
+        .queue = queue,
+        .segment_max = runtime.send_batch_size * 2,
+    };
+    send_batch_init(&r.lte_batch, GRECP_TUNTYPE_LTE, sockfd_gre);
+    send_batch_init(&r.dsl_batch, GRECP_TUNTYPE_DSL, sockfd_gre);
+    if (!flowlet_table_create(&r.flowlets))
+        logger(LOG_FATAL, "Allocating flowlet table failed.\n");
+    r.segments = runtime.tunnel_offload ? malloc((size_t)r.segment_max * MAX_PKT_SIZE) : NULL;
+    pthread_cleanup_push(tun2gre_reader_destroy, &r);
+
+    /* packets stay in here until both batches are flushed, with offloads they are up to 64k and preceded by a vnet header */
+    size_t slot_size = runtime.tunnel_offload ? sizeof(struct virtio_net_hdr) + MAX_GSO_PKT_SIZE : MAX_PKT_SIZE;
+    unsigned char *packets = malloc((size_t)runtime.send_batch_size * slot_size);
+    pthread_cleanup_push(free, packets);
+    struct uring uring = {
+        .fd = -1,
+    };
+    if ((runtime.io_uring) && (!tun2gre_uring_open(&uring, fd, packets, slot_size))) {
+        logger(LOG_ERROR, "Setting up io_uring for tun device reads failed, reading one packet at a time.\n");
+        uring_close(&uring);
+    }
+    pthread_cleanup_push(uring_close, &uring);
+    unsigned char *buffer;
+    ssize_t size;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (true) {
+        /* wait for the first packet, then drain the tun device until the batch is full */
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno != EINTR)
+                logger(LOG_ERROR, "Tun device poll failed: %s\n", strerror(errno));
+            continue;
+        }
+
+        if (uring.fd >= 0) {
+            tun2gre_uring_read(&uring, &r, packets, slot_size);
         } else {
-            logger(LOG_ERROR, "Tun device read failed: %s\n", strerror(errno));
+            for (int i=0; i<runtime.send_batch_size; i++) {
+                buffer = packets + (size_t)i * slot_size;
+                size = read(fd, buffer, slot_size);
+                if (size <= 0) {
+                    if ((size < 0) && (errno != EAGAIN))
+                        logger(LOG_ERROR, "Tun device read failed: %s\n", strerror(errno));
+                    break;
+                }
+                //logger_hexdump(LOG_DEBUG, buffer, size, "buffer:");
+                tun2gre_read(&r, buffer, size);
+            }
+        }
+
+        tun2gre_flush(&r);
+    }
+
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+}
+
+/* fill the batch from one queue of each tun device queue, taking turns between them */
+static void tunnel_sender_fill(struct tunnel_sender *s, struct ring *rings) {
+    struct queued_packet *packet;
+    void *slot;
+    uint16_t size;
+    bool found;
+    do {
+        found = false;
+        for (uint8_t i=0; (i<runtime.tunnel_queues) && (s->batch.count < runtime.send_batch_size); i++) {
+            if (!ring_pop(&rings[i], &slot, &size))
+                continue;
+            packet = (struct queued_packet *)slot;
+            s->queues[s->batch.count] = i;
+            send_batch_add(&s->batch, packet->proto, atomic_fetch_add_explicit(&sequence, 1, memory_order_relaxed), packet->payload, size);
+            found = true;
+        }
+    } while ((found) && (s->batch.count < runtime.send_batch_size));
+}
+
+/* send whatever the readers queued for the tunnel, a batch at a time, priority packets first */
+static void tunnel_sender_run(struct tunnel_sender *s) {
+    eventfd_t wakeups;
+    struct pollfd pfd = { .fd = s->batch.fd, .events = POLLOUT };
+    while (true) {
+        /* sequence numbers are taken while filling, so only fill once the socket has room */
+        if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR))
+            logger(LOG_ERROR, "Raw socket poll failed: %s\n", strerror(errno));
+
+        tunnel_sender_fill(s, s->priority);
+        tunnel_sender_fill(s, s->packets);
+
+        if (s->batch.count == 0) {
+            eventfd_read(s->eventfd, &wakeups);
+            continue;
+        }
+
+        unsigned int count = s->batch.count;
+        send_batch_flush(&s->batch);
+        for (unsigned int i=0; i<count; i++)
+            ring_push(&s->returned[s->queues[i]], s->batch.iovecs[i * 2 + 1].iov_base, 0);
+    }
+}
+
+static void *tunnel_sender_main(void *arg) {
+    struct tunnel_sender *s = (struct tunnel_sender *)arg;
+    char threadname[IF_NAMESIZE];
+    snprintf(threadname, sizeof(threadname), "%.11s-%s", runtime.tunnel_interface_name, (s->batch.tuntype == GRECP_TUNTYPE_LTE) ? "lte" : "dsl");
+    pthread_setname_np(pthread_self(), threadname);
+
+    tunnel_sender_run(s);
+    return NULL;
+}
+
+static void tunnel_sender_close(struct tunnel_sender *s) {
+    if (s->started) {
+        pthread_cancel(s->thread);
+        pthread_join(s->thread, NULL);
+        s->started = false;
+    }
+    if (s->batch.fd >= 0)
+        close(s->batch.fd);
+    if (s->eventfd >= 0)
+        close(s->eventfd);
+    send_batch_destroy(&s->batch);
+    free(s->queues);
+    for (int i=0; i<MAX_TUNNEL_QUEUES; i++) {
+        ring_destroy(&s->packets[i]);
+        ring_destroy(&s->priority[i]);
+        ring_destroy(&s->returned[i]);
+    }
+}
+
+static bool tunnel_sender_open(struct tunnel_sender *s, uint8_t tuntype) {
+    send_batch_init(&s->batch, tuntype, open_gre_send_socket());
+    s->eventfd = eventfd(0, 0);
+    s->queues = calloc(runtime.send_batch_size, sizeof(uint8_t));
+    if ((s->batch.fd < 0) || (s->eventfd < 0) || (!s->queues))
+        return false;
+    for (uint8_t i=0; i<runtime.tunnel_queues; i++) {
+        if ((!ring_create(&s->packets[i], runtime.send_queue_size)) || (!ring_create(&s->priority[i], runtime.send_queue_size)) ||
+            (!ring_create(&s->returned[i], senders.pools[i].slots)))
+            return false;
+    }
+    return (s->started = (pthread_create(&s->thread, NULL, &tunnel_sender_main, s) == 0));
+}
+
+/* readers are stopped first, nothing is queued anymore once the senders go */
+static void tunnel_senders_stop(void *arg) {
+    (void)arg;
+    senders.active = false;
+    tunnel_sender_close(&senders.lte);
+    tunnel_sender_close(&senders.dsl);
+    for (int i=0; i<MAX_TUNNEL_QUEUES; i++)
+        pool_destroy(&senders.pools[i]);
+}
+
+/* every tun device queue gets a pool for packets queued for the tunnels, enough to fill all their queues and batches */
+static void tunnel_senders_start() {
+    memset(&senders, 0, sizeof(senders));
+    senders.lte.batch.fd = -1;
+    senders.lte.eventfd = -1;
+    senders.dsl.batch.fd = -1;
+    senders.dsl.eventfd = -1;
+    if (runtime.send_queue_size == 0)
+        return;
+
+    bool ok = true;
+    for (uint8_t i=0; i<runtime.tunnel_queues; i++)
+        ok = ok && pool_create(&senders.pools[i], (runtime.send_queue_size * 2 + runtime.send_batch_size) * 2, sizeof(struct queued_packet));
+    if ((!ok) || (!tunnel_sender_open(&senders.lte, GRECP_TUNTYPE_LTE)) || (!tunnel_sender_open(&senders.dsl, GRECP_TUNTYPE_DSL))) {
+        logger(LOG_ERROR, "Setting up tunnel senders failed, sending from the tun device readers.\n");
+        tunnel_senders_stop(NULL);
+        return;
+    }
+    senders.active = true;
+}
+
+static void *tun2gre_queue_main(void *arg) {
+    uint8_t queue = (uintptr_t)arg;
+    char threadname[IF_NAMESIZE];
+    snprintf(threadname, sizeof(threadname), "%.7s-send%hhu", runtime.tunnel_interface_name, queue);
+    pthread_setname_np(pthread_self(), threadname);
+
+    tun2gre_queue(queue);
+    return NULL;
+}
+
+struct tun2gre_queue_threads {
+    pthread_t threads[MAX_TUNNEL_QUEUES];
+    uint8_t count;
+};
+
+static void tun2gre_queue_threads_stop(void *arg) {
+    struct tun2gre_queue_threads *queues = (struct tun2gre_queue_threads *)arg;
+    for (int i=0; i<queues->count; i++) {
+        pthread_cancel(queues->threads[i]);
+        pthread_join(queues->threads[i], NULL);
+    }
+}
+
+void *tun2gre_main() {
+    char threadname[IF_NAMESIZE];
+    snprintf(threadname, sizeof(threadname), "%.9s-send", runtime.tunnel_interface_name);
+    pthread_setname_np(pthread_self(), threadname);
+
+    atomic_store(&sequence, runtime.sequence_soak_test ? SEQUENCE_SOAK_TEST_START : 0);
+    scheduler_reset();
+    tunnel_senders_start();
+    pthread_cleanup_push(tunnel_senders_stop, NULL);
+
+    /* this thread serves the first queue, every other one gets a thread of its own */
+    struct tun2gre_queue_threads queues = {};
+    pthread_cleanup_push(tun2gre_queue_threads_stop, &queues);
+    for (uint8_t i=1; i<runtime.tunnel_queues; i++) {
+        if (pthread_create(&queues.threads[queues.count], NULL, &tun2gre_queue_main, (void *)(uintptr_t)i) != 0) {
+            logger(LOG_ERROR, "Starting sender thread for tun device queue %u failed.\n", i);
+            continue;
         }
+        queues.count++;
     }
+
+    tun2gre_queue(0);
+
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+    return NULL;
 }
\ No newline at end of file
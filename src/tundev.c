@@ -22,10 +22,17 @@
 #include <linux/ip6_tunnel.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/filter.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <net/ethernet.h>
 
+/* udp segmentation offload, newer than some of the kernel headers we're built against */
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20
+#define TUN_F_USO6 0x40
+#endif
+
 bool create_gre_tunnel_dev() {
     struct mnl_socket *nl_sock = NULL;
     if ((nl_sock = mnl_socket_open(NETLINK_ROUTE)) == NULL) {
@@ -118,22 +125,44 @@ bool destroy_gre_tunnel_dev() {
 }
 
 bool create_tun_tunnel_dev() {
-    if ((sockfd_tun = open("/dev/net/tun", O_RDWR)) < 0 ) {
-        logger(LOG_ERROR, "Opening /dev/net/tun failed: %s\n", strerror(errno));
-        return false;
-    }
-
     struct ifreq ifr;
     memset(&ifr, 0, sizeof(ifr));
     ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_NOFILTER;
+    if (runtime.tunnel_queues > 1)
+        ifr.ifr_flags |= IFF_MULTI_QUEUE; /* one fd per queue, spreading work across cores */
+    if (runtime.tunnel_offload)
+        ifr.ifr_flags |= IFF_VNET_HDR; /* every packet is preceded by a struct virtio_net_hdr */
+
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", runtime.tunnel_interface_name);
+
+    for (int i=0; i<runtime.tunnel_queues; i++) {
+        if ((sockfd_tun_queues[i] = open("/dev/net/tun", O_RDWR)) < 0 ) {
+            logger(LOG_ERROR, "Opening /dev/net/tun failed: %s\n", strerror(errno));
+            while (i > 0)
+                close(sockfd_tun_queues[--i]);
+            return false;
+        }
+
+        if (ioctl(sockfd_tun_queues[i], TUNSETIFF, (void *)&ifr) < 0 ) {
+            logger(LOG_ERROR, "Creation of Tunnel interface '%s' failed: %s\n", runtime.tunnel_interface_name, strerror(errno));
+            close(sockfd_tun_queues[i]);
+            while (i > 0)
+                close(sockfd_tun_queues[--i]);
+            return false;
+        }
 
-    strncpy(ifr.ifr_name, runtime.tunnel_interface_name, strlen(runtime.tunnel_interface_name));
+        /* large tcp and udp packets in both directions, checksums are completed by whoever splits them */
+        if ((runtime.tunnel_offload) && (i == 0)) {
+            if ((ioctl(sockfd_tun_queues[i], TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_USO4 | TUN_F_USO6) < 0) &&
+                (ioctl(sockfd_tun_queues[i], TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0)) {
+                logger(LOG_ERROR, "Enabling offloads for tunnel interface '%s' failed: %s\n", runtime.tunnel_interface_name, strerror(errno));
+            }
+        }
 
-    if (ioctl(sockfd_tun, TUNSETIFF, (void *)&ifr) < 0 ) {
-        logger(LOG_ERROR, "Creation of Tunnel interface '%s' failed: %s\n", runtime.tunnel_interface_name, strerror(errno));
-        close(sockfd_tun);
-        return false;
+        /* tun2gre drains the device until it would block, writes are not affected by this */
+        fcntl(sockfd_tun_queues[i], F_SETFL, fcntl(sockfd_tun_queues[i], F_GETFL) | O_NONBLOCK);
     }
+    sockfd_tun = sockfd_tun_queues[0];
 
     int gen_fd = socket(PF_INET, SOCK_DGRAM, 0);
 
@@ -160,7 +189,8 @@ bool create_tun_tunnel_dev() {
 }
 
 bool destroy_tun_tunnel_dev() {
-    close(sockfd_tun);
+    for (int i=0; i<runtime.tunnel_queues; i++)
+        close(sockfd_tun_queues[i]);
 
     logger(LOG_INFO, "Tunnel interface '%s' destroyed.\n", runtime.tunnel_interface_name);
     trigger_event("tunneldown");
@@ -181,20 +211,33 @@ bool destroy_tunnel_dev() {
         return destroy_gre_tunnel_dev();
 }
 
-void open_gre_socket() {
-    sockfd_gre = socket(AF_INET6, SOCK_RAW, IPPROTO_GRE);
-    if (sockfd_gre < 0) {
-        logger(LOG_FATAL, "Creation of raw socket failed: %s\n", strerror(errno));
-    }
-
-    /* Set timeout for blocking reads */
-    struct timeval read_timeout = { .tv_sec = 0, .tv_usec = 100000 };
-    if (setsockopt(sockfd_gre, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof(read_timeout)) < 0) {
-        logger(LOG_FATAL, "Configuration of raw socket failed: %s\n", strerror(errno));
-    }
-
-    /* BPF filter to only get ipv4/6 data messages for our tunnel */
-    struct sock_filter bpfcode[] = {
+/* interfaces whose gre packets are received by packet sockets instead of the raw socket */
+static int gre_socket_ignored_ifindexes[2];
+static uint8_t gre_socket_ignored_count = 0;
+/* the receiver sets them while the main thread swaps filters on haap changes */
+static pthread_mutex_t gre_socket_filter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* BPF filter to only get ipv4/6 data messages of the haap for our tunnel
+ * raw sockets start at the gre header, the ipv6 source address is loaded relative to the network header */
+static void attach_gre_socket_filter_locked() {
+    struct sock_filter bpfcode[3 + 18] = {};
+    uint8_t n = 0;
+    if (gre_socket_ignored_count > 0)
+        bpfcode[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_IFINDEX); /* load incoming interface */
+    for (int i=0; i<gre_socket_ignored_count; i++)
+        bpfcode[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, gre_socket_ignored_ifindexes[i], gre_socket_ignored_count - i - 1 + 17, 0); /* discard if it's == an ignored interface */
+    struct sock_filter gre[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 8), /* load ip6->saddr */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[0]), 0, 15), /* skip next 15 lines if it's != runtime.haap.ip */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[1]), 0, 13),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 16),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[2]), 0, 11),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[3]), 0, 9),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0), /* load gre->flags_and_version */
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, ~(GRECP_FLAGSANDVERSION_WITH_SEQ ^ GRECP_FLAGSANDVERSION) & 0xffff), /* ignore the sequence flag */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, GRECP_FLAGSANDVERSION, 0, 6), /* skip next 6 lines if it's != GRECP_FLAGSANDVERSION */
         BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4), /* load gre->key */
         BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, runtime.haap.bonding_key, 0, 4), /* skip next 4 lines if it's != runtime.haap.bonding_key */
         BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2), /* load gre->proto */
@@ -203,17 +246,126 @@ void open_gre_socket() {
         BPF_STMT(BPF_RET | BPF_K, -1), /* accept packet */
         BPF_STMT(BPF_RET | BPF_K, 0), /* discard packet */
     };
+    memcpy(&bpfcode[n], gre, sizeof(gre));
     struct sock_fprog bpfprog = {
-        .len = 7,
+        .len = n + 18,
         .filter = bpfcode,
     };
     if (setsockopt(sockfd_gre, SOL_SOCKET, SO_ATTACH_FILTER, &bpfprog, sizeof(bpfprog)) < 0) {
         logger(LOG_ERROR, "Attaching BPF failed: %s\n", strerror(errno));
     }
+}
+
+void attach_gre_socket_filter() {
+    pthread_mutex_lock(&gre_socket_filter_lock);
+    attach_gre_socket_filter_locked();
+    pthread_mutex_unlock(&gre_socket_filter_lock);
+}
+
+/* the raw socket would get copies of packets received by packet sockets */
+void ignore_gre_socket_interfaces(int *ifindexes, uint8_t count) {
+    pthread_mutex_lock(&gre_socket_filter_lock);
+    memcpy(gre_socket_ignored_ifindexes, ifindexes, count * sizeof(int));
+    gre_socket_ignored_count = count;
+    attach_gre_socket_filter_locked();
+    pthread_mutex_unlock(&gre_socket_filter_lock);
+}
+
+/* BPF filter to only get control messages of the haap for our session, accept messages start a new one */
+void attach_grecp_socket_filter() {
+    struct sock_filter bpfcode[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 8), /* load ip6->saddr */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[0]), 0, 16), /* skip next 16 lines if it's != runtime.haap.ip */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[1]), 0, 14),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 16),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[2]), 0, 12),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(runtime.haap.ip.s6_addr32[3]), 0, 10),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0), /* load gre->flags_and_version */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, GRECP_FLAGSANDVERSION, 0, 8), /* skip next 8 lines if it's != GRECP_FLAGSANDVERSION */
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2), /* load gre->proto */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, GRECP_PROTO, 0, 6), /* skip next 6 lines if it's != GRECP_PROTO  */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4), /* load gre->key */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, runtime.haap.bonding_key, 3, 0), /* skip next 3 lines if it's == runtime.haap.bonding_key */
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 8), /* load grecp->msgtype_and_tuntype */
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, GRECP_MSGTYPE_ACCEPT << 4, 0, 1), /* skip next line if it's != GRECP_MSGTYPE_ACCEPT */
+        BPF_STMT(BPF_RET | BPF_K, -1), /* accept packet */
+        BPF_STMT(BPF_RET | BPF_K, 0), /* discard packet */
+    };
+    struct sock_fprog bpfprog = {
+        .len = 19,
+        .filter = bpfcode,
+    };
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &bpfprog, sizeof(bpfprog)) < 0) {
+        logger(LOG_ERROR, "Attaching BPF failed: %s\n", strerror(errno));
+    }
+}
+
+/* SO_ATTACH_FILTER replaces filters atomically, swap them whenever the haap address or bonding key change */
+void update_socket_filters() {
+    static struct in6_addr haap_ip;
+    static uint32_t bonding_key;
+    if ((memcmp(&haap_ip, &runtime.haap.ip, sizeof(struct in6_addr)) == 0) && (bonding_key == runtime.haap.bonding_key))
+        return;
+    haap_ip = runtime.haap.ip;
+    bonding_key = runtime.haap.bonding_key;
+
+    attach_grecp_socket_filter();
+    if (sockfd_gre)
+        attach_gre_socket_filter();
+}
+
+void open_gre_socket() {
+    sockfd_gre = socket(AF_INET6, SOCK_RAW, IPPROTO_GRE);
+    if (sockfd_gre < 0) {
+        logger(LOG_FATAL, "Creation of raw socket failed: %s\n", strerror(errno));
+    }
+
+    /* Tell us which address packets were sent to, so we know the tunnel they arrived on */
+    int enable = 1;
+    if (setsockopt(sockfd_gre, IPPROTO_IPV6, IPV6_RECVPKTINFO, &enable, sizeof(enable)) < 0) {
+        logger(LOG_ERROR, "Enabling packet info on raw socket failed: %s\n", strerror(errno));
+    }
+
+    /* Age buffered packets by the time the kernel received them, not when we got around to reading them */
+    if (setsockopt(sockfd_gre, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0) {
+        logger(LOG_ERROR, "Enabling receive timestamps on raw socket failed: %s\n", strerror(errno));
+    }
+
+    attach_gre_socket_filter();
 
     /* TODO: increase recv buffer, maybe? */
 }
 
+/* non-blocking socket a tunnel sender sends with, a full send buffer must not stall the other tunnel
+ * raw sockets get a copy of every gre packet, this one doesn't read them so it drops them all right away */
+int open_gre_send_socket() {
+    int fd = socket(AF_INET6, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_GRE);
+    if (fd < 0) {
+        logger(LOG_ERROR, "Creation of raw socket for sending failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sock_filter bpfcode[1] = {
+        BPF_STMT(BPF_RET | BPF_K, 0), /* discard packet */
+    };
+    struct sock_fprog bpfprog = {
+        .len = 1,
+        .filter = bpfcode,
+    };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &bpfprog, sizeof(bpfprog)) < 0) {
+        logger(LOG_ERROR, "Attaching BPF failed: %s\n", strerror(errno));
+    }
+
+    return fd;
+}
+
 void close_gre_socket() {
     close(sockfd_gre);
+    sockfd_gre = 0;
+    pthread_mutex_lock(&gre_socket_filter_lock);
+    gre_socket_ignored_count = 0;
+    pthread_mutex_unlock(&gre_socket_filter_lock);
 }
\ No newline at end of file
@@ -16,5 +16,10 @@
  */
 bool create_tunnel_dev();
 bool destroy_tunnel_dev();
+void attach_gre_socket_filter();
+void ignore_gre_socket_interfaces(int *ifindexes, uint8_t count);
+void attach_grecp_socket_filter();
+void update_socket_filters();
 void open_gre_socket();
+int open_gre_send_socket();
 void close_gre_socket();
\ No newline at end of file
@@ -0,0 +1,213 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "openhybrid.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* entries is rounded up to a power of two by the kernel, the completion queue gets four times as many
+ * completions are posted when we enter the kernel, instead of interrupting whatever we're doing */
+bool uring_open(struct uring *ring, unsigned int entries) {
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN,
+        .cq_entries = entries * 4,
+    };
+    if ((ring->fd = uring_setup(entries, &params)) < 0) {
+        logger(LOG_ERROR, "Creation of io_uring failed: %s\n", strerror(errno));
+        return false;
+    }
+    /* linux 5.4 and newer map both queues at once, everything else is older than the features we need anyway */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        logger(LOG_ERROR, "Creation of io_uring failed: Kernel is too old.\n");
+        uring_close(ring);
+        return false;
+    }
+
+    ring->map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->map_size)
+        ring->map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        logger(LOG_ERROR, "Mapping io_uring failed: %s\n", strerror(errno));
+        uring_close(ring);
+        return false;
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        logger(LOG_ERROR, "Mapping io_uring submission queue entries failed: %s\n", strerror(errno));
+        uring_close(ring);
+        return false;
+    }
+
+    unsigned char *map = ring->map;
+    ring->sq_head = (unsigned int *)(map + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(map + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(map + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_queued = *ring->sq_tail;
+    ring->cq_head = (unsigned int *)(map + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(map + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+
+    /* submission queue entries are always used in order */
+    unsigned int *array = (unsigned int *)(map + params.sq_off.array);
+    for (unsigned int i=0; i<params.sq_entries; i++)
+        array[i] = i;
+    return true;
+}
+
+void uring_close(void *arg) {
+    struct uring *ring = (struct uring *)arg;
+    if (ring->fd < 0)
+        return;
+    if (ring->buffers)
+        munmap(ring->buffers, ring->buffer_entries * sizeof(struct io_uring_buf));
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    if (ring->map)
+        munmap(ring->map, ring->map_size);
+    free(ring->buffer_slots);
+    close(ring->fd);
+    ring->fd = -1;
+    ring->buffers = NULL;
+    ring->buffer_slots = NULL;
+    ring->sqes = NULL;
+    ring->map = NULL;
+}
+
+/* used with IOSQE_FIXED_FILE by their index, saves looking them up for every request */
+bool uring_register_files(struct uring *ring, int *fds, unsigned int count) {
+    if (uring_register(ring->fd, IORING_REGISTER_FILES, fds, count) < 0) {
+        logger(LOG_ERROR, "Registering files with io_uring failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* pinned once, so fixed reads and writes within it don't have to map the pages for every request */
+bool uring_register_buffer(struct uring *ring, void *base, size_t size) {
+    struct iovec iovec = {
+        .iov_base = base,
+        .iov_len = size,
+    };
+    if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iovec, 1) < 0) {
+        logger(LOG_ERROR, "Registering buffer with io_uring failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* entries must be a power of two, requires linux 5.19 or newer */
+bool uring_buffers_create(struct uring *ring, uint16_t entries) {
+    ring->buffer_entries = entries;
+    ring->buffer_tail = 0;
+    ring->buffer_count = 0;
+    ring->buffers = mmap(NULL, entries * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        logger(LOG_ERROR, "Allocation of io_uring buffer ring failed: %s\n", strerror(errno));
+        return false;
+    }
+    ring->buffer_slots = calloc(entries, sizeof(void *));
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)ring->buffers,
+        .ring_entries = entries,
+        .bgid = 0,
+    };
+    if ((!ring->buffer_slots) || (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)) {
+        logger(LOG_ERROR, "Registering io_uring buffer ring failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* returns false if the ring is full, the kernel takes buffers in the order they were provided */
+bool uring_buffer_provide(struct uring *ring, void *buffer, uint32_t size) {
+    if (ring->buffer_count == ring->buffer_entries)
+        return false;
+    uint16_t bid = ring->buffer_tail & (ring->buffer_entries - 1);
+    ring->buffers->bufs[bid].addr = (uintptr_t)buffer;
+    ring->buffers->bufs[bid].len = size;
+    ring->buffers->bufs[bid].bid = bid;
+    ring->buffer_slots[bid] = buffer;
+    ring->buffer_count++;
+    __atomic_store_n(&ring->buffers->tail, ++ring->buffer_tail, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* buffer the kernel picked for a completion, NULL if it didn't pick one */
+void *uring_buffer_take(struct uring *ring, uint32_t cqe_flags) {
+    if (!(cqe_flags & IORING_CQE_F_BUFFER))
+        return NULL;
+    ring->buffer_count--;
+    return ring->buffer_slots[cqe_flags >> IORING_CQE_BUFFER_SHIFT];
+}
+
+/* returns a cleared entry, NULL if the submission queue is full */
+struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    if (ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+        return NULL;
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_queued++ & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/* submit everything queued, and wait for at least that many completions
+ * completions the kernel has pending for us are posted in any case */
+int uring_submit(struct uring *ring, unsigned int wait) {
+    unsigned int count = ring->sq_queued - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+    int res;
+    do {
+        res = uring_enter(ring->fd, count, wait, IORING_ENTER_GETEVENTS);
+    } while ((res < 0) && (errno == EINTR));
+    return res;
+}
+
+/* the ring polls readable if completions are pending, but some are only posted once we enter the kernel */
+void uring_complete(struct uring *ring) {
+    if (uring_submit(ring, 0) < 0)
+        logger(LOG_ERROR, "Posting io_uring completions failed: %s\n", strerror(errno));
+}
+
+/* next completion, NULL if there is none */
+struct io_uring_cqe *uring_cqe(struct uring *ring) {
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <linux/io_uring.h>
+
+/* io_uring set up with raw system calls, see io_uring(7)
+ * submission and completion queues are mapped from the kernel */
+struct uring {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    /* entries handed out by uring_sqe(), published to the kernel on submit */
+    unsigned int sq_queued;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    void *map;
+    size_t map_size;
+    /* buffers the kernel picks from for multishot receives, buffer group 0 */
+    struct io_uring_buf_ring *buffers;
+    uint16_t buffer_entries;
+    uint16_t buffer_tail;
+    uint16_t buffer_count;
+    /* what's in the ring, by buffer id */
+    void **buffer_slots;
+};
+
+bool uring_open(struct uring *ring, unsigned int entries);
+void uring_close(void *arg);
+bool uring_register_files(struct uring *ring, int *fds, unsigned int count);
+bool uring_register_buffer(struct uring *ring, void *base, size_t size);
+bool uring_buffers_create(struct uring *ring, uint16_t entries);
+bool uring_buffer_provide(struct uring *ring, void *buffer, uint32_t size);
+void *uring_buffer_take(struct uring *ring, uint32_t cqe_flags);
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned int wait);
+void uring_complete(struct uring *ring);
+struct io_uring_cqe *uring_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
\ No newline at end of file
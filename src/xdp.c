@@ -0,0 +1,421 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "openhybrid.h"
+#include <libmnl/libmnl.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#ifndef ARPHRD_RAWIP
+#define ARPHRD_RAWIP 519
+#endif
+
+#define BPF_INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+static int bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* length of the link layer header xdp programs see in front of the ip header, -1 if unsupported */
+static int xdp_l2_size(char *interface_name) {
+    struct ifreq ifr = {};
+    strncpy(ifr.ifr_name, interface_name, IF_NAMESIZE - 1);
+    int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    int res = ioctl(fd, SIOCGIFHWADDR, &ifr);
+    close(fd);
+    if (res < 0)
+        return -1;
+    switch (ifr.ifr_hwaddr.sa_family) {
+        case ARPHRD_ETHER:
+        case ARPHRD_LOOPBACK:
+            return 14;
+        case ARPHRD_PPP:
+        case ARPHRD_NONE:
+        case ARPHRD_RAWIP:
+            return 0;
+    }
+    return -1;
+}
+
+static uint32_t xdp_rx_queues(char *interface_name) {
+    struct ethtool_channels channels = { .cmd = ETHTOOL_GCHANNELS };
+    struct ifreq ifr = {};
+    strncpy(ifr.ifr_name, interface_name, IF_NAMESIZE - 1);
+    ifr.ifr_data = (void *)&channels;
+    int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    int res = ioctl(fd, SIOCETHTOOL, &ifr);
+    close(fd);
+    uint32_t queues = channels.rx_count + channels.combined_count;
+    if ((res < 0) || (queues == 0))
+        return 1;
+    return (queues > XDP_MAX_QUEUES) ? XDP_MAX_QUEUES : queues;
+}
+
+/* redirect ipv6 gre data packets of the haap with our key to the af_xdp socket of the rx queue, pass everything else */
+static int xdp_load_program(int map_fd, uint8_t l2_size) {
+    struct bpf_insn insns[] = {
+        BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0), /* r6 = ctx */
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data), 0), /* r2 = data */
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end), 0), /* r3 = data_end */
+        BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+        BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, l2_size + 40 + 8),
+        BPF_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 34, 0), /* pass if shorter than ipv6 and gre header with key */
+        l2_size ? BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0) : BPF_INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0), /* load ethertype */
+        l2_size ? BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 32, htons(ETHERTYPE_IPV6)) : BPF_INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0), /* pass if it's != ETHERTYPE_IPV6 */
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, l2_size, 0), /* load ip6->version */
+        BPF_INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0xf0),
+        BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 29, 0x60), /* pass if it's != 6 */
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, l2_size + 6, 0), /* load ip6->next_header */
+        BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 27, IPPROTO_GRE), /* pass if it's != IPPROTO_GRE */
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, l2_size + 8, 0), /* load ip6->saddr */
+        BPF_INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, runtime.haap.ip.s6_addr32[0]),
+        BPF_INSN(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_5, BPF_REG_4, 24, 0), /* pass if it's != runtime.haap.ip */
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, l2_size + 12, 0),
+        BPF_INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, runtime.haap.ip.s6_addr32[1]),
+        BPF_INSN(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_5, BPF_REG_4, 21, 0),
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, l2_size + 16, 0),
+        BPF_INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, runtime.haap.ip.s6_addr32[2]),
+        BPF_INSN(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_5, BPF_REG_4, 18, 0),
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, l2_size + 20, 0),
+        BPF_INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, runtime.haap.ip.s6_addr32[3]),
+        BPF_INSN(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_5, BPF_REG_4, 15, 0),
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, l2_size + 40, 0), /* load gre->flags_and_version */
+        BPF_INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(~(GRECP_FLAGSANDVERSION_WITH_SEQ ^ GRECP_FLAGSANDVERSION) & 0xffff)), /* ignore the sequence flag */
+        BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 12, htons(GRECP_FLAGSANDVERSION)), /* pass if it's != GRECP_FLAGSANDVERSION */
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, l2_size + 42, 0), /* load gre->proto */
+        BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, 1, htons(ETHERTYPE_IP)), /* skip next line if it's == ETHERTYPE_IP */
+        BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 9, htons(ETHERTYPE_IPV6)), /* pass if it's != ETHERTYPE_IPV6 */
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, l2_size + 44, 0), /* load gre->key */
+        BPF_INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, htonl(runtime.haap.bonding_key)), /* 32 bit move, not sign extended */
+        BPF_INSN(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_5, BPF_REG_4, 6, 0), /* pass if it's != runtime.haap.bonding_key */
+        BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0), /* r2 = rx queue */
+        BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd), /* r1 = xskmap */
+        BPF_INSN(0, 0, 0, 0, 0),
+        BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS), /* pass if there's no socket for the queue */
+        BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS), /* pass */
+        BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    char license[] = "GPL";
+    char log[4096];
+    union bpf_attr attr = {};
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t)insns;
+    attr.insn_cnt = sizeof(insns) / sizeof(struct bpf_insn);
+    attr.license = (uintptr_t)license;
+    int fd = bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0) {
+        logger(LOG_ERROR, "Loading XDP program failed: %s\n", strerror(errno));
+        /* once more with the verifier telling us why */
+        attr.log_buf = (uintptr_t)log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+        log[0] = 0;
+        bpf(BPF_PROG_LOAD, &attr);
+        logger(LOG_DEBUG, "XDP verifier log:\n%s\n", log);
+    }
+    return fd;
+}
+
+/* prog_fd -1 detaches */
+static bool xdp_attach(int ifindex, int prog_fd) {
+    struct mnl_socket *nl_sock = NULL;
+    if ((nl_sock = mnl_socket_open(NETLINK_ROUTE)) == NULL) {
+        logger(LOG_ERROR, "Opening netlink socket failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    uint8_t buf[MNL_SOCKET_BUFFER_SIZE];
+    memset(buf, 0, MNL_SOCKET_BUFFER_SIZE);
+    struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    nlh->nlmsg_type = RTM_SETLINK;
+
+    struct ifinfomsg *ifinfo = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
+    ifinfo->ifi_family = AF_UNSPEC;
+    ifinfo->ifi_index = ifindex;
+
+    struct nlattr *xdpinfo = mnl_attr_nest_start(nlh, IFLA_XDP);
+    mnl_attr_put_u32(nlh, IFLA_XDP_FD, prog_fd);
+    mnl_attr_put_u32(nlh, IFLA_XDP_FLAGS, runtime.xdp_native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE);
+    mnl_attr_nest_end(nlh, xdpinfo);
+
+    mnl_socket_sendto(nl_sock, nlh, nlh->nlmsg_len);
+    mnl_socket_recvfrom(nl_sock, buf, sizeof(buf));
+    mnl_socket_close(nl_sock);
+
+    nlh = (struct nlmsghdr*) buf;
+    if (nlh->nlmsg_type == NLMSG_ERROR) {
+        struct nlmsgerr *nlerr = mnl_nlmsg_get_payload(nlh);
+        if (nlerr->error) {
+            logger(LOG_ERROR, "%s XDP program on interface %i failed: %s\n", (prog_fd < 0) ? "Detaching" : "Attaching", ifindex, strerror(-nlerr->error));
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *xdp_map_ring(int fd, struct xdp_ring *ring, struct xdp_ring_offset *offset, size_t desc_size, off_t pgoff) {
+    ring->map_size = offset->desc + XDP_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return NULL;
+    }
+    ring->producer = (_Atomic uint32_t *)((unsigned char *)ring->map + offset->producer);
+    ring->consumer = (_Atomic uint32_t *)((unsigned char *)ring->map + offset->consumer);
+    ring->descs = (unsigned char *)ring->map + offset->desc;
+    return ring->map;
+}
+
+static void xdp_close_socket(struct xdp_socket *s) {
+    if (s->rx.map)
+        munmap(s->rx.map, s->rx.map_size);
+    if (s->fill.map)
+        munmap(s->fill.map, s->fill.map_size);
+    if (s->fd >= 0)
+        close(s->fd);
+    s->rx.map = NULL;
+    s->fill.map = NULL;
+    s->fd = -1;
+}
+
+/* the whole pool is the umem, frames can move freely between the sockets and the reorder buffer
+ * the first socket registers it, the others share it and only get fill and rx rings of their own
+ * umem_fd is the socket to share it with, -1 to register it */
+static bool xdp_open_socket(struct xdp *xdp, struct xdp_socket *s, int ifindex, uint32_t queue, int umem_fd) {
+    s->umem = xdp->pool->slab;
+    if ((s->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+        logger(LOG_ERROR, "Creation of AF_XDP socket failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct xdp_umem_reg umem = {
+        .addr = (uintptr_t)xdp->pool->slab,
+        .len = (uint64_t)xdp->pool->slots * xdp->pool->slot_size,
+        .chunk_size = xdp->pool->slot_size,
+    };
+    int size = XDP_RING_SIZE;
+    struct xdp_mmap_offsets offsets;
+    socklen_t optlen = sizeof(offsets);
+    if (((umem_fd < 0) && (setsockopt(s->fd, SOL_XDP, XDP_UMEM_REG, &umem, sizeof(umem)) < 0)) ||
+        (setsockopt(s->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0) ||
+        (setsockopt(s->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0) ||
+        (setsockopt(s->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0) ||
+        (getsockopt(s->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &optlen) < 0)) {
+        logger(LOG_ERROR, "Configuration of AF_XDP socket failed: %s\n", strerror(errno));
+        return false;
+    }
+    if ((!xdp_map_ring(s->fd, &s->rx, &offsets.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING)) ||
+        (!xdp_map_ring(s->fd, &s->fill, &offsets.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING))) {
+        logger(LOG_ERROR, "Mapping AF_XDP rings failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct sockaddr_xdp addr = {
+        .sxdp_family = AF_XDP,
+        .sxdp_flags = runtime.xdp_native ? 0 : XDP_COPY,
+        .sxdp_ifindex = ifindex,
+        .sxdp_queue_id = queue,
+    };
+    if (umem_fd >= 0) {
+        /* the mode is taken from the socket that registered the umem */
+        addr.sxdp_flags = XDP_SHARED_UMEM;
+        addr.sxdp_shared_umem_fd = umem_fd;
+    }
+    if (bind(s->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        logger((umem_fd >= 0) ? LOG_DEBUG : LOG_ERROR, "Binding AF_XDP socket to queue %u failed: %s\n", queue, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void xdp_close_interface(struct xdp *xdp, struct xdp_interface *xi) {
+    if (xi->attached)
+        xdp_attach(xi->ifindex, -1);
+    if (xi->prog_fd >= 0)
+        close(xi->prog_fd);
+    if (xi->map_fd >= 0)
+        close(xi->map_fd);
+    for (int i=xi->first_socket; i<xi->first_socket + xi->socket_count; i++)
+        xdp_close_socket(&xdp->sockets[i]);
+}
+
+static bool xdp_setup_interface(struct xdp *xdp, struct xdp_interface *xi, char *interface_name, uint8_t tuntype) {
+    if ((xi->ifindex = if_nametoindex(interface_name)) == 0) {
+        logger(LOG_ERROR, "XDP: Interface '%s' not found.\n", interface_name);
+        return false;
+    }
+    int l2_size = xdp_l2_size(interface_name);
+    if (l2_size < 0) {
+        logger(LOG_ERROR, "XDP: Link type of interface '%s' is not supported.\n", interface_name);
+        return false;
+    }
+    uint32_t queues = xdp_rx_queues(interface_name);
+
+    union bpf_attr attr = {};
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = queues;
+    if ((xi->map_fd = bpf(BPF_MAP_CREATE, &attr)) < 0) {
+        logger(LOG_ERROR, "Creation of XDP socket map failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct xdp_socket *s;
+    for (uint32_t queue=0; queue<queues; queue++) {
+        s = &xdp->sockets[xi->first_socket + xi->socket_count++];
+        s->fd = -1;
+        s->rx.map = NULL;
+        s->fill.map = NULL;
+        s->tuntype = tuntype;
+        s->l2_size = l2_size;
+        /* kernels before 5.10 only share a umem between sockets of the same queue, those register it again */
+        bool opened = xdp_open_socket(xdp, s, xi->ifindex, queue, xdp->umem_fd);
+        if ((!opened) && (xdp->umem_fd >= 0)) {
+            xdp_close_socket(s);
+            opened = xdp_open_socket(xdp, s, xi->ifindex, queue, -1);
+        }
+        if (!opened)
+            return false;
+        if (xdp->umem_fd < 0)
+            xdp->umem_fd = s->fd;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = xi->map_fd;
+        attr.key = (uintptr_t)&queue;
+        attr.value = (uintptr_t)&s->fd;
+        if (bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+            logger(LOG_ERROR, "Adding AF_XDP socket to map failed: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    if ((xi->prog_fd = xdp_load_program(xi->map_fd, l2_size)) < 0)
+        return false;
+    return (xi->attached = xdp_attach(xi->ifindex, xi->prog_fd));
+}
+
+/* an interface that can't be set up is left to the raw socket */
+static void xdp_open_interface(struct xdp *xdp, char *interface_name, uint8_t tuntype) {
+    struct xdp_interface *xi = &xdp->interfaces[xdp->interface_count];
+    xi->map_fd = -1;
+    xi->prog_fd = -1;
+    xi->attached = false;
+    xi->first_socket = xdp->count;
+    xi->socket_count = 0;
+    int umem_fd = xdp->umem_fd;
+    if (!xdp_setup_interface(xdp, xi, interface_name, tuntype)) {
+        xdp_close_interface(xdp, xi);
+        xdp->umem_fd = umem_fd;
+        return;
+    }
+    xdp->interface_count++;
+    xdp->count += xi->socket_count;
+    logger(LOG_INFO, "XDP: Receiving gre packets on interface '%s' with %u queue(s).\n", interface_name, xi->socket_count);
+}
+
+/* set up af_xdp sockets on the lte and dsl interfaces, receiving into slots of pool */
+bool xdp_open(struct xdp *xdp, struct packet_pool *pool) {
+    xdp->pool = pool;
+    xdp->interface_count = 0;
+    xdp->count = 0;
+    xdp->umem_fd = -1;
+
+    /* older kernels charge maps and umem against the locked memory limit */
+    struct rlimit unlimited = { .rlim_cur = RLIM_INFINITY, .rlim_max = RLIM_INFINITY };
+    setrlimit(RLIMIT_MEMLOCK, &unlimited);
+
+    xdp_open_interface(xdp, runtime.lte.interface_name, GRECP_TUNTYPE_LTE);
+    if (strlen(runtime.dsl.interface_name) > 0)
+        xdp_open_interface(xdp, runtime.dsl.interface_name, GRECP_TUNTYPE_DSL);
+
+    /* the kernel needs frames to receive into, it drops redirected packets until then */
+    xdp_refill(xdp);
+    return (xdp->interface_count > 0);
+}
+
+void xdp_close(void *arg) {
+    struct xdp *xdp = (struct xdp *)arg;
+    for (int i=0; i<xdp->interface_count; i++)
+        xdp_close_interface(xdp, &xdp->interfaces[i]);
+    xdp->interface_count = 0;
+    xdp->count = 0;
+    xdp->umem_fd = -1;
+    xdp->outstanding = 0;
+}
+
+/* af_xdp sockets xdp_open sets up at most, each of them keeps a fill ring worth of pool slots */
+uint8_t xdp_max_sockets() {
+    uint8_t count = xdp_rx_queues(runtime.lte.interface_name);
+    if (strlen(runtime.dsl.interface_name) > 0)
+        count += xdp_rx_queues(runtime.dsl.interface_name);
+    return count;
+}
+
+/* give the kernel pool slots to receive into, leaving enough for a receive batch of the raw socket
+ * frames sitting in rx rings count as well, the kernel never holds more than a fill ring worth per socket
+ * so the slots of the reorder buffer stay untouched */
+void xdp_refill(struct xdp *xdp) {
+    struct xdp_socket *s;
+    uint64_t *addrs;
+    uint32_t producer;
+    uint32_t free;
+    uint32_t n;
+    void *slot;
+    uint32_t max = (uint32_t)xdp->count * XDP_RING_SIZE;
+    for (int i=0; i<xdp->count; i++) {
+        s = &xdp->sockets[i];
+        addrs = (uint64_t *)s->fill.descs;
+        producer = atomic_load_explicit(s->fill.producer, memory_order_relaxed);
+        free = XDP_RING_SIZE - (producer - atomic_load_explicit(s->fill.consumer, memory_order_acquire));
+        for (n=0; (n < free) && (xdp->outstanding < max) && (xdp->pool->free_count > runtime.receive_batch_size); n++) {
+            slot = pool_get(xdp->pool);
+            addrs[(producer + n) & (XDP_RING_SIZE - 1)] = (unsigned char *)slot - xdp->pool->slab;
+            xdp->outstanding++;
+        }
+        atomic_store_explicit(s->fill.producer, producer + n, memory_order_release);
+    }
+}
+
+/* number of received frames ready to be looked at, up to max */
+uint32_t xdp_peek(struct xdp_socket *s, uint32_t max) {
+    uint32_t available = atomic_load_explicit(s->rx.producer, memory_order_acquire) - atomic_load_explicit(s->rx.consumer, memory_order_relaxed);
+    return (available < max) ? available : max;
+}
+
+/* returns the ipv6 packet of a received frame, it's a pool slot and has to go back into the pool eventually */
+unsigned char *xdp_frame(struct xdp_socket *s, uint32_t index, uint16_t *size) {
+    struct xdp_desc *desc = &((struct xdp_desc *)s->rx.descs)[(atomic_load_explicit(s->rx.consumer, memory_order_relaxed) + index) & (XDP_RING_SIZE - 1)];
+    *size = desc->len - s->l2_size;
+    return s->umem + desc->addr + s->l2_size;
+}
+
+/* frames handed out by xdp_frame aren't in the ring anymore */
+void xdp_consume(struct xdp *xdp, struct xdp_socket *s, uint32_t count) {
+    xdp->outstanding -= count;
+    atomic_store_explicit(s->rx.consumer, atomic_load_explicit(s->rx.consumer, memory_order_relaxed) + count, memory_order_release);
+}
\ No newline at end of file
@@ -0,0 +1,78 @@
+/* OpenHybrid - an open GRE tunnel bonding implemantion
+ * Copyright (C) 2019  Friedrich Oslage <friedrich@oslage.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <linux/if_xdp.h>
+#include <stdatomic.h>
+
+/* frames received by af_xdp sockets are pool slots, the kernel wants them to be a power of two */
+#define XDP_FRAME_SIZE 2048
+
+/* receive and fill ring size of each af_xdp socket */
+#define XDP_RING_SIZE 256
+
+/* af_xdp sockets per interface, packets arriving on other rx queues take the regular path */
+#define XDP_MAX_QUEUES 8
+
+/* ring shared with the kernel, mapped from the socket */
+struct xdp_ring {
+    _Atomic uint32_t *producer;
+    _Atomic uint32_t *consumer;
+    void *descs;
+    void *map;
+    size_t map_size;
+};
+
+struct xdp_socket {
+    int fd;
+    uint8_t tuntype;
+    /* link layer header in front of the ipv6 header */
+    uint8_t l2_size;
+    /* the whole packet pool is registered as umem, so descriptors are offsets into it */
+    unsigned char *umem;
+    struct xdp_ring rx;
+    struct xdp_ring fill;
+};
+
+struct xdp_interface {
+    int ifindex;
+    int map_fd;
+    int prog_fd;
+    bool attached;
+    /* sockets of the interface, one per rx queue */
+    uint8_t first_socket;
+    uint8_t socket_count;
+};
+
+struct xdp {
+    struct packet_pool *pool;
+    struct xdp_interface interfaces[2];
+    uint8_t interface_count;
+    struct xdp_socket sockets[2 * XDP_MAX_QUEUES];
+    uint8_t count;
+    /* socket that registered the umem */
+    int umem_fd;
+    /* pool slots in fill and rx rings, capped to the share the pool has set aside for them */
+    uint32_t outstanding;
+};
+
+/* returns false if no interface could be set up */
+uint8_t xdp_max_sockets();
+bool xdp_open(struct xdp *xdp, struct packet_pool *pool);
+void xdp_close(void *arg);
+void xdp_refill(struct xdp *xdp);
+uint32_t xdp_peek(struct xdp_socket *s, uint32_t max);
+unsigned char *xdp_frame(struct xdp_socket *s, uint32_t index, uint16_t *size);
+void xdp_consume(struct xdp *xdp, struct xdp_socket *s, uint32_t count);
\ No newline at end of file